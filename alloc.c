@@ -1,10 +1,19 @@
 #include "wrapper.h"
 #define ALLOCATED 1
 #define FREE 0
+#define RELOCATABLE 2 // allocated block reachable only through a handle, compaction may move it
 #define BLOCK_STATE_SIZE 1
 #define BLOCK_HEADER_SIZE 5 // block_state + size
 #define BLOCK_TAIL_SIZE 4	// pointer to start of block
 #define BLOCK_METADATA_SIZE (BLOCK_HEADER_SIZE + BLOCK_TAIL_SIZE)
+#define HANDLE_SIZE 4 // relocatable block starts with its handle, so that compaction can update the handle table
+#define HANDLE_TABLE_ENTRIES 16 // initial number of handles, the table doubles when it is full
+#define HANDLE_TABLE 0 // handle stored in the handle table block itself, compaction moves the table like other blocks
+#define COMPACT_STEP_BUDGET 1024 // bytes walked and copied by one compaction step run by the allocator
+#define COMPACT_RETRY_STEPS 16 // compaction steps run by failed relocatable allocation before it gives up
+
+unsigned int handle_table_addr = 0; // data address of the handle table block, 0 before the first handle is taken
+unsigned int compact_cursor = 0;	// block where the next compaction step continues
 
 // writes 4 byte integer
 void mwrite4(unsigned int addr, unsigned int val)
@@ -39,6 +48,12 @@ unsigned int mread4(unsigned int addr)
 	return (unsigned int)u1 << 24 | (unsigned int)u2 << 16 | (unsigned int)u3 << 8 | (unsigned int)u4 << 0;
 }
 
+// highest address where a block can start, every block has at least one byte of data
+unsigned int last_block_addr(void)
+{
+	return msize() - 1 - BLOCK_METADATA_SIZE;
+}
+
 void best_fit(unsigned int searched_size, unsigned int *best_fit_addr, unsigned int *best_fit_block_size)
 {
 	unsigned int block_loc = 0;
@@ -68,6 +83,8 @@ void my_init(void)
 	mwrite(0, 0);							   // 1 byte = block_state
 	mwrite4(1, msize() - BLOCK_METADATA_SIZE); // 4 bytes = available space
 	mwrite4(msize() - BLOCK_TAIL_SIZE, 0);	   // pointer to the start of block (block_state byte)
+	handle_table_addr = 0;
+	compact_cursor = 0;
 }
 
 int my_alloc(unsigned int size)
@@ -135,7 +152,7 @@ int my_free(unsigned int addr)
 	unsigned int next_block_addr = block_start_addr + block_size + BLOCK_METADATA_SIZE;
 
 	// if next block is free we can merge it with current block
-	if (next_block_addr < msize() - 1 - BLOCK_METADATA_SIZE && mread(next_block_addr) == FREE)
+	if (next_block_addr <= last_block_addr() && mread(next_block_addr) == FREE)
 	{
 		unsigned int next_block_size = mread4(next_block_addr + BLOCK_STATE_SIZE);
 		unsigned int next_block_tail_addr = next_block_addr + BLOCK_HEADER_SIZE + next_block_size;
@@ -143,6 +160,9 @@ int my_free(unsigned int addr)
 		block_tail_addr = next_block_tail_addr;
 		write_head(block_start_addr, FREE, block_size);
 		write_tail(next_block_tail_addr, block_start_addr);
+		// compaction can not continue from a block which does not exist anymore
+		if (compact_cursor == next_block_addr)
+			compact_cursor = block_start_addr;
 	}
 
 	// if previous block is free we can merge it with current block
@@ -155,8 +175,307 @@ int my_free(unsigned int addr)
 			unsigned int prev_block_size = mread4(prev_block_addr + BLOCK_STATE_SIZE);
 			write_head(prev_block_addr, FREE, prev_block_size + block_size + BLOCK_METADATA_SIZE);
 			write_tail(block_tail_addr, prev_block_addr);
+			if (compact_cursor == block_start_addr)
+				compact_cursor = prev_block_addr;
 		}
 	}
 
 	return OK;
 }
+
+// address of the handle table entry, which holds data address of the block or 0 for unused handle, entries follow
+// the handle of the table
+unsigned int handle_entry_addr(int handle)
+{
+	return handle_table_addr + (unsigned int)handle * HANDLE_SIZE;
+}
+
+// number of handles the table can hold, it is given by size of its block
+unsigned int handle_table_entries(void)
+{
+	if (handle_table_addr == 0)
+		return 0;
+	return mread4(handle_table_addr - BLOCK_HEADER_SIZE + BLOCK_STATE_SIZE) / HANDLE_SIZE - 1;
+}
+
+// moves relocatable block at 'block_addr' down to the start of the free block right before it, free space
+// ends up behind the moved block and is merged with the next free block
+void slide_block(unsigned int free_addr, unsigned int free_size, unsigned int block_addr)
+{
+	unsigned int block_size = mread4(block_addr + BLOCK_STATE_SIZE);
+	unsigned int handle = mread4(block_addr + BLOCK_HEADER_SIZE);
+
+	// destination is below the source, so copying upwards never overwrites bytes which were not copied yet
+	for (unsigned int i = 0; i < BLOCK_HEADER_SIZE + block_size; i++)
+		mwrite(free_addr + i, mread(block_addr + i));
+	write_tail(free_addr + BLOCK_HEADER_SIZE + block_size, free_addr);
+	if (handle == HANDLE_TABLE)
+		handle_table_addr = free_addr + BLOCK_HEADER_SIZE;
+	else
+		mwrite4(handle_entry_addr((int)handle), free_addr + BLOCK_HEADER_SIZE);
+
+	unsigned int new_free_addr = free_addr + BLOCK_METADATA_SIZE + block_size;
+	unsigned int next_block_addr = block_addr + BLOCK_METADATA_SIZE + block_size;
+	if (next_block_addr <= last_block_addr() && mread(next_block_addr) == FREE)
+		free_size = free_size + mread4(next_block_addr + BLOCK_STATE_SIZE) + BLOCK_METADATA_SIZE;
+	write_head(new_free_addr, FREE, free_size);
+	write_tail(new_free_addr + BLOCK_HEADER_SIZE + free_size, new_free_addr);
+}
+
+// one step of compaction, it slides relocatable blocks over free blocks in front of them, so free space gathers
+// behind them, the step walks and copies at most 'budget' bytes, only a block larger than the budget is moved by
+// a step which did nothing else yet, so the pass never gets stuck on it, returns 1 if the pass is not finished yet,
+// 0 when it reached the end of memory and the next step starts a new pass
+int my_compact_step(unsigned int budget)
+{
+	unsigned int spent = 0;
+	while (compact_cursor <= last_block_addr())
+	{
+		if (spent >= budget)
+			return 1;
+
+		unsigned int block_addr = compact_cursor;
+		unsigned int block_size = mread4(block_addr + BLOCK_STATE_SIZE);
+		unsigned int next_block_addr = block_addr + BLOCK_METADATA_SIZE + block_size;
+		spent += BLOCK_METADATA_SIZE;
+		if (mread(block_addr) != FREE || next_block_addr > last_block_addr() ||
+			mread(next_block_addr) != RELOCATABLE)
+		{
+			compact_cursor = next_block_addr;
+			continue;
+		}
+
+		// the step continues from this free block next time
+		unsigned int moved_size = mread4(next_block_addr + BLOCK_STATE_SIZE);
+		if (spent > BLOCK_METADATA_SIZE && spent + moved_size > budget)
+			return 1;
+		slide_block(block_addr, block_size, next_block_addr);
+		spent += moved_size;
+		// the free block is behind the moved block now and the next block may be moved over it too
+		compact_cursor = block_addr + BLOCK_METADATA_SIZE + moved_size;
+	}
+	compact_cursor = 0;
+	return 0;
+}
+
+// allocates relocatable block of 'size' bytes, which starts with 'handle', if free space is scattered between blocks,
+// a few compaction steps slide relocatable blocks together and allocation is retried after each of them, so the
+// pause stays bounded, returns FAIL if there is still not enough space
+int alloc_relocatable(unsigned int size, unsigned int handle)
+{
+	int addr = my_alloc(size);
+	for (int step = 0; addr == FAIL && step < COMPACT_RETRY_STEPS; step++)
+	{
+		my_compact_step(COMPACT_STEP_BUDGET);
+		addr = my_alloc(size);
+	}
+	if (addr == FAIL)
+		return FAIL;
+	mwrite((unsigned int)addr - BLOCK_HEADER_SIZE, RELOCATABLE);
+	mwrite4((unsigned int)addr, handle);
+	return addr;
+}
+
+// returns unused handle, the table is created or doubled when there is none, returns FAIL if the table can not grow
+int take_handle(void)
+{
+	unsigned int entries = handle_table_entries();
+	for (unsigned int i = 1; i <= entries; i++)
+		if (mread4(handle_entry_addr((int)i)) == 0)
+			return (int)i;
+
+	// table is relocatable too, so it never pins free space in the middle of memory
+	unsigned int new_entries = entries == 0 ? HANDLE_TABLE_ENTRIES : entries * 2;
+	int new_table_addr = alloc_relocatable((new_entries + 1) * HANDLE_SIZE, HANDLE_TABLE);
+	if (new_table_addr == FAIL)
+		return FAIL;
+	// block may be larger than requested, all entries it holds are initialized, because their number is given by it
+	new_entries = mread4((unsigned int)new_table_addr - BLOCK_HEADER_SIZE + BLOCK_STATE_SIZE) / HANDLE_SIZE - 1;
+	for (unsigned int i = 1; i <= new_entries; i++)
+		mwrite4((unsigned int)new_table_addr + i * HANDLE_SIZE, i <= entries ? mread4(handle_entry_addr((int)i)) : 0);
+	if (handle_table_addr != 0)
+	{
+		mwrite(handle_table_addr - BLOCK_HEADER_SIZE, ALLOCATED);
+		my_free(handle_table_addr);
+	}
+	handle_table_addr = (unsigned int)new_table_addr;
+	return (int)entries + 1;
+}
+
+// allocates relocatable block and returns its handle, address of its data is given by my_hderef and stays valid only
+// until the next my_halloc, my_hfree or my_compact_step, which may move the block, returns FAIL if there is not
+// enough space even after compaction
+int my_halloc(unsigned int size)
+{
+	if (size > msize() - BLOCK_METADATA_SIZE - HANDLE_SIZE)
+		return FAIL;
+	int handle = take_handle();
+	if (handle == FAIL)
+		return FAIL;
+
+	int addr = alloc_relocatable(size + HANDLE_SIZE, (unsigned int)handle);
+	if (addr == FAIL)
+		return FAIL;
+	mwrite4(handle_entry_addr(handle), (unsigned int)addr);
+	return handle;
+}
+
+// returns current address of data of relocatable block, or FAIL for invalid handle
+int my_hderef(int handle)
+{
+	if (handle < 1 || (unsigned int)handle > handle_table_entries())
+		return FAIL;
+	unsigned int addr = mread4(handle_entry_addr(handle));
+	if (addr == 0)
+		return FAIL;
+	return (int)(addr + HANDLE_SIZE);
+}
+
+// frees relocatable block, returns FAIL for invalid handle
+int my_hfree(int handle)
+{
+	if (handle < 1 || (unsigned int)handle > handle_table_entries())
+		return FAIL;
+	unsigned int addr = mread4(handle_entry_addr(handle));
+	if (addr == 0 || mread(addr - BLOCK_HEADER_SIZE) != RELOCATABLE)
+		return FAIL;
+
+	// block is freed as a regular allocated block, so it is merged with free neighbours
+	mwrite(addr - BLOCK_HEADER_SIZE, ALLOCATED);
+	mwrite4(handle_entry_addr(handle), 0);
+	if (my_free(addr) == FAIL)
+		return FAIL;
+	// every free leaves a hole, one compaction step keeps the pass going, so free space is gathered before
+	// an allocation needs it
+	my_compact_step(COMPACT_STEP_BUDGET);
+	return OK;
+}
+
+// sorts addresses of a batch in place, batches are small, so insertion sort is enough
+void sort_addrs(unsigned int addrs[], unsigned int n)
+{
+	for (unsigned int i = 1; i < n; i++)
+	{
+		unsigned int addr = addrs[i];
+		unsigned int j = i;
+		for (; j > 0 && addrs[j - 1] > addr; j--)
+			addrs[j] = addrs[j - 1];
+		addrs[j] = addr;
+	}
+}
+
+// frees blocks with data addresses in 'addrs' in one walk over memory, the array is sorted in place, freed blocks
+// are merged with free neighbours on the way, returns FAIL if some address is not an allocated block, other blocks
+// are freed anyway
+int my_free_many(unsigned int addrs[], unsigned int n)
+{
+	sort_addrs(addrs, n);
+
+	int result = OK;
+	unsigned int i = 0;
+	unsigned int block_addr = 0;
+	unsigned int free_run_addr = 0; // start of free block right before the current block
+	int in_free_run = 0;
+	// after the last freed block the walk continues only to merge it with the next block
+	while (block_addr <= msize() - 1 - BLOCK_METADATA_SIZE && (i < n || in_free_run))
+	{
+		unsigned int block_data_addr = block_addr + BLOCK_HEADER_SIZE;
+		unsigned int block_size = mread4(block_addr + BLOCK_STATE_SIZE);
+		for (; i < n && addrs[i] < block_data_addr; i++)
+			result = FAIL;
+		if (i < n && addrs[i] == block_data_addr)
+		{
+			if (mread(block_addr) == ALLOCATED)
+				mwrite(block_addr, FREE);
+			else
+				result = FAIL;
+			// the same address given more times is freed only once
+			for (i++; i < n && addrs[i] == block_data_addr; i++)
+				result = FAIL;
+		}
+
+		unsigned int next_block_addr = block_addr + BLOCK_METADATA_SIZE + block_size;
+		if (mread(block_addr) != FREE)
+		{
+			in_free_run = 0;
+		}
+		else if (!in_free_run)
+		{
+			free_run_addr = block_addr;
+			in_free_run = 1;
+		}
+		else
+		{
+			write_head(free_run_addr, FREE, next_block_addr - free_run_addr - BLOCK_METADATA_SIZE);
+			write_tail(next_block_addr - BLOCK_TAIL_SIZE, free_run_addr);
+			// compaction can not continue from a block which does not exist anymore
+			if (compact_cursor == block_addr)
+				compact_cursor = free_run_addr;
+		}
+		block_addr = next_block_addr;
+	}
+
+	// addresses after the end of memory
+	if (i < n)
+		result = FAIL;
+	return result;
+}
+
+// allocates blocks of sizes 'sizes' and stores their data addresses in 'out', the whole batch is carved from one free
+// block found by a single best fit search, if there is no such block, blocks are allocated one by one, returns FAIL
+// and allocates nothing if some block can not be allocated
+int my_alloc_many(unsigned int sizes[], unsigned int n, int out[])
+{
+	if (n == 0)
+		return OK;
+
+	// blocks follow one another, so metadata of all but the first block take space from the free block too
+	unsigned int total_size = 0;
+	int fits = 1;
+	for (unsigned int i = 0; i < n && fits; i++)
+	{
+		if (sizes[i] > msize() - BLOCK_METADATA_SIZE || total_size > msize())
+			fits = 0;
+		else
+			total_size += sizes[i] + (i > 0 ? BLOCK_METADATA_SIZE : 0);
+	}
+
+	unsigned int best_fit_addr;
+	unsigned int best_fit_block_size = 0;
+	if (fits && total_size <= msize() - BLOCK_METADATA_SIZE)
+		best_fit(total_size, &best_fit_addr, &best_fit_block_size);
+
+	if (best_fit_block_size == 0)
+	{
+		for (unsigned int i = 0; i < n; i++)
+		{
+			out[i] = my_alloc(sizes[i]);
+			if (out[i] == FAIL)
+			{
+				my_free_many((unsigned int *)out, i);
+				return FAIL;
+			}
+		}
+		return OK;
+	}
+
+	// if unused space is too small (metadata can not fit), the last block gets it like in my_alloc
+	unsigned int unused_size = best_fit_block_size - total_size;
+	unsigned int block_addr = best_fit_addr;
+	for (unsigned int i = 0; i < n; i++)
+	{
+		unsigned int block_size = sizes[i];
+		if (i == n - 1 && unused_size <= BLOCK_METADATA_SIZE)
+			block_size += unused_size;
+		write_head(block_addr, ALLOCATED, block_size);
+		write_tail(block_addr + BLOCK_HEADER_SIZE + block_size, block_addr);
+		out[i] = (int)(block_addr + BLOCK_HEADER_SIZE);
+		block_addr = block_addr + BLOCK_METADATA_SIZE + block_size;
+	}
+	if (unused_size > BLOCK_METADATA_SIZE)
+	{
+		write_head(block_addr, FREE, unused_size - BLOCK_METADATA_SIZE);
+		write_tail(block_addr + unused_size - BLOCK_TAIL_SIZE, block_addr);
+	}
+	return OK;
+}
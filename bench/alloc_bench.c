@@ -0,0 +1,256 @@
+// benchmark driver for alloc.c, it runs allocation workloads against a heap kept in memory
+//
+// build: cc -O2 -I<directory with wrapper.h> bench/alloc_bench.c alloc.c -o alloc_bench
+// usage: alloc_bench [-m heap bytes] [-n live blocks] [-s max block size] [-i iterations] [workload ...]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "wrapper.h"
+
+// alloc.c functions
+void my_init(void);
+int my_alloc(unsigned int size);
+int my_free(unsigned int addr);
+int my_halloc(unsigned int size);
+int my_hderef(int handle);
+int my_hfree(int handle);
+int my_alloc_many(unsigned int sizes[], unsigned int n, int out[]);
+int my_free_many(unsigned int addrs[], unsigned int n);
+
+uint8_t *heap = NULL;
+unsigned int heap_size = 40000;
+
+size_t slots = 400; // about half of them hold a block at any time
+unsigned int max_block_size = 300;
+size_t iterations = 200000;
+
+// in-memory heap
+
+uint8_t mread(unsigned int addr)
+{
+	if (addr >= heap_size)
+	{
+		fprintf(stderr, "read of address %u out of heap\n", addr);
+		exit(1);
+	}
+	return heap[addr];
+}
+
+void mwrite(unsigned int addr, uint8_t val)
+{
+	if (addr >= heap_size)
+	{
+		fprintf(stderr, "write of address %u out of heap\n", addr);
+		exit(1);
+	}
+	heap[addr] = val;
+}
+
+unsigned int msize(void)
+{
+	return heap_size;
+}
+
+// helpers
+
+uint64_t now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// random numbers do not depend on the C library, so both allocators get the same sequence of requests
+uint64_t random_state = 1;
+
+uint64_t random_next()
+{
+	random_state = random_state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return random_state >> 33;
+}
+
+void check(int ok, const char *what)
+{
+	if (!ok)
+	{
+		fprintf(stderr, "%s failed\n", what);
+		exit(1);
+	}
+}
+
+void reset_heap()
+{
+	memset(heap, 0, heap_size);
+	my_init();
+	random_state = 1;
+}
+
+// workloads
+
+// random slots are allocated and freed, with raw addresses and with handles, the same sequence of requests is
+// given to both, live bytes show how much data the heap held on average
+void bench_churn()
+{
+	int *blocks = calloc(slots, sizeof(int));
+	unsigned int *sizes = calloc(slots, sizeof(unsigned int));
+	check(blocks != NULL && sizes != NULL, "calloc");
+	printf("%-8s %10s %10s %8s %12s %10s\n", "api", "allocs", "fails", "fail %", "live bytes", "ns/op");
+	for (int handles = 0; handles <= 1; handles++)
+	{
+		reset_heap();
+		memset(blocks, 0, slots * sizeof(int));
+		size_t allocs = 0;
+		size_t fails = 0;
+		uint64_t live = 0;
+		uint64_t live_sum = 0;
+		uint64_t start = now_ns();
+		for (size_t i = 0; i < iterations; i++)
+		{
+			size_t slot = random_next() % slots;
+			unsigned int size = 1 + random_next() % max_block_size;
+			if (blocks[slot] != 0)
+			{
+				check((handles ? my_hfree(blocks[slot]) : my_free(blocks[slot])) == OK, "free");
+				blocks[slot] = 0;
+				live -= sizes[slot];
+			}
+			else
+			{
+				allocs++;
+				int block = handles ? my_halloc(size) : my_alloc(size);
+				if (block == FAIL)
+				{
+					fails++;
+				}
+				else
+				{
+					blocks[slot] = block;
+					sizes[slot] = size;
+					live += size;
+				}
+			}
+			live_sum += live;
+		}
+		double ns = (double)(now_ns() - start) / iterations;
+		printf("%-8s %10zu %10zu %8.3f %12.0f %10.0f\n", handles ? "handles" : "raw", allocs, fails,
+			   100.0 * fails / allocs, (double)live_sum / iterations, ns);
+	}
+	free(blocks);
+	free(sizes);
+}
+
+#define BATCH_MAX 64
+#define BATCH_BLOCK_SIZE 64 // batches are made of small objects
+
+// batches of small blocks are allocated and freed with the batch calls and with one call per block, every second
+// block of the heap is kept allocated, so that walks over the heap pass many blocks
+void bench_batch()
+{
+	unsigned int batch_sizes[] = {8, 32, BATCH_MAX};
+	unsigned int sizes[BATCH_MAX];
+	int blocks[BATCH_MAX];
+	printf("%-8s %6s %14s %14s\n", "api", "batch", "alloc ns/obj", "free ns/obj");
+	for (size_t b = 0; b < sizeof(batch_sizes) / sizeof(batch_sizes[0]); b++)
+	{
+		unsigned int n = batch_sizes[b];
+		for (int batch = 0; batch <= 1; batch++)
+		{
+			reset_heap();
+			for (size_t i = 0; i < slots; i++)
+			{
+				int block = my_alloc(1 + random_next() % BATCH_BLOCK_SIZE);
+				if (block != FAIL && i % 2 == 0)
+					my_free(block);
+			}
+
+			uint64_t alloc_ns = 0;
+			uint64_t free_ns = 0;
+			size_t rounds = iterations / n;
+			for (size_t r = 0; r < rounds; r++)
+			{
+				for (unsigned int i = 0; i < n; i++)
+					sizes[i] = 1 + random_next() % BATCH_BLOCK_SIZE;
+				uint64_t start = now_ns();
+				if (batch)
+				{
+					check(my_alloc_many(sizes, n, blocks) == OK, "my_alloc_many");
+				}
+				else
+				{
+					for (unsigned int i = 0; i < n; i++)
+						check((blocks[i] = my_alloc(sizes[i])) != FAIL, "my_alloc");
+				}
+				uint64_t middle = now_ns();
+				if (batch)
+				{
+					check(my_free_many((unsigned int *)blocks, n) == OK, "my_free_many");
+				}
+				else
+				{
+					for (unsigned int i = 0; i < n; i++)
+						check(my_free(blocks[i]) == OK, "my_free");
+				}
+				alloc_ns += middle - start;
+				free_ns += now_ns() - middle;
+			}
+			printf("%-8s %6u %14.0f %14.0f\n", batch ? "batch" : "single", n, (double)alloc_ns / (rounds * n),
+				   (double)free_ns / (rounds * n));
+		}
+	}
+}
+
+typedef struct
+{
+	const char *name;
+	void (*run)();
+} workload_t;
+
+workload_t workloads[] = {
+	{"churn", bench_churn},
+	{"batch", bench_batch},
+};
+#define WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+int main(int argc, char **argv)
+{
+	int i = 1;
+	for (; i + 1 < argc && argv[i][0] == '-'; i += 2)
+	{
+		long value = atol(argv[i + 1]);
+		if (strcmp(argv[i], "-m") == 0)
+			heap_size = value;
+		else if (strcmp(argv[i], "-n") == 0)
+			slots = 2 * value;
+		else if (strcmp(argv[i], "-s") == 0)
+			max_block_size = value;
+		else if (strcmp(argv[i], "-i") == 0)
+			iterations = value;
+		else
+			break;
+	}
+	if (i < argc && argv[i][0] == '-')
+	{
+		fprintf(stderr, "usage: %s [-m heap bytes] [-n live blocks] [-s max block size] [-i iterations] [workload ...]\n", argv[0]);
+		return 1;
+	}
+
+	heap = malloc(heap_size);
+	check(heap != NULL, "malloc");
+	for (size_t w = 0; w < WORKLOADS; w++)
+	{
+		int selected = i == argc;
+		for (int a = i; a < argc; a++)
+			selected |= strcmp(argv[a], workloads[w].name) == 0;
+		if (selected)
+		{
+			printf("== %s\n", workloads[w].name);
+			workloads[w].run();
+			printf("\n");
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,464 @@
+// benchmark driver for filesystem.c, it runs standard workloads against a disk image kept in memory and reports
+// operations per second and I/O per operation
+//
+// build: cc -O2 -I<directory with filesystem.h and util.h> bench/fs_bench.c filesystem.c -lpthread -o fs_bench
+// usage: fs_bench [-d disk MiB] [-n files] [-s large file KiB] [-l device latency us] [workload ...]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "filesystem.h"
+#include "util.h"
+
+// filesystem.c functions which are not part of filesystem.h
+void fs_io_stats_reset();
+void fs_io_stats_print();
+int fs_sync();
+
+uint8_t *disk = NULL;
+size_t disk_sectors = 0;
+long device_latency_us = 0; // every sector access waits this long, like a round trip to a real device
+_Atomic uint64_t disk_reads = 0;
+
+size_t file_count = 1000;
+size_t large_file_size = 4 << 20;
+uint8_t *buffer = NULL;		 // source of all writes, large enough for a whole large file
+uint8_t *read_buffer = NULL; // destination of reads, what they return is compared with 'buffer'
+
+uint64_t bench_start_ns = 0;
+
+// in-memory disk
+
+void device_wait()
+{
+	if (device_latency_us == 0)
+		return;
+	struct timespec wait = {device_latency_us / 1000000, (device_latency_us % 1000000) * 1000};
+	nanosleep(&wait, NULL);
+}
+
+void hdd_read(size_t sector, void *buffer)
+{
+	if (sector >= disk_sectors)
+	{
+		fprintf(stderr, "read of sector %zu out of disk\n", sector);
+		exit(1);
+	}
+	device_wait();
+	disk_reads++;
+	memcpy(buffer, disk + sector * SECTOR_SIZE, SECTOR_SIZE);
+}
+
+void hdd_write(size_t sector, const void *buffer)
+{
+	if (sector >= disk_sectors)
+	{
+		fprintf(stderr, "write of sector %zu out of disk\n", sector);
+		exit(1);
+	}
+	device_wait();
+	memcpy(disk + sector * SECTOR_SIZE, buffer, SECTOR_SIZE);
+}
+
+size_t hdd_size()
+{
+	return disk_sectors * SECTOR_SIZE;
+}
+
+file_t *fd_alloc()
+{
+	return calloc(1, sizeof(file_t));
+}
+
+void fd_free(file_t *fd)
+{
+	free(fd);
+}
+
+// helpers
+
+uint64_t now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// random numbers do not depend on the C library, so runs are comparable across machines
+uint64_t random_state = 1;
+
+uint64_t random_next()
+{
+	random_state = random_state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return random_state >> 33;
+}
+
+void check(int ok, const char *what)
+{
+	if (!ok)
+	{
+		fprintf(stderr, "%s failed\n", what);
+		exit(1);
+	}
+}
+
+void file_path(char *path, const char *prefix, size_t i)
+{
+	snprintf(path, MAX_PATH, "%s%zu", prefix, i);
+}
+
+// data read from 'offset' of a file created by make_file have to match what was written there
+void check_data(const uint8_t *data, size_t offset, size_t size)
+{
+	check(memcmp(data, buffer + offset, size) == 0, "data check");
+}
+
+// creates file 'path' with 'size' bytes of data
+void make_file(const char *path, size_t size)
+{
+	file_t *fd = fs_creat(path);
+	check(fd != NULL, "fs_creat");
+	check(fs_write(fd, buffer, size) == (int)size, "fs_write");
+	fs_close(fd);
+}
+
+// called by workloads once their setup is done, only the rest is measured
+void bench_start()
+{
+	fs_sync();
+	fs_io_stats_reset();
+	bench_start_ns = now_ns();
+}
+
+// workloads, every one of them starts on a freshly formatted disk and returns number of operations it measured
+
+size_t bench_create()
+{
+	bench_start();
+	char path[MAX_PATH];
+	for (size_t i = 0; i < file_count; i++)
+	{
+		file_path(path, "/f", i);
+		file_t *fd = fs_creat(path);
+		check(fd != NULL, "fs_creat");
+		fs_close(fd);
+	}
+	return file_count;
+}
+
+size_t bench_seqwrite()
+{
+	bench_start();
+	file_t *fd = fs_creat("/large");
+	check(fd != NULL, "fs_creat");
+	size_t chunk = 4096;
+	for (size_t pos = 0; pos < large_file_size; pos += chunk)
+		check(fs_write(fd, buffer + pos, chunk) == (int)chunk, "fs_write");
+	fs_close(fd);
+	return large_file_size / chunk;
+}
+
+size_t bench_seqread()
+{
+	make_file("/large", large_file_size);
+	bench_start();
+	file_t *fd = fs_open("/large");
+	check(fd != NULL, "fs_open");
+	size_t chunk = 4096;
+	for (size_t pos = 0; pos < large_file_size; pos += chunk)
+	{
+		check(fs_read(fd, read_buffer, chunk) == (int)chunk, "fs_read");
+		check_data(read_buffer, pos, chunk);
+	}
+	fs_close(fd);
+	return large_file_size / chunk;
+}
+
+size_t bench_randread()
+{
+	make_file("/large", large_file_size);
+	bench_start();
+	file_t *fd = fs_open("/large");
+	check(fd != NULL, "fs_open");
+	size_t chunk = 256;
+	size_t reads = large_file_size / 4096;
+	for (size_t i = 0; i < reads; i++)
+	{
+		size_t offset = random_next() % (large_file_size - chunk);
+		check(fs_seek(fd, offset) == OK, "fs_seek");
+		check(fs_read(fd, read_buffer, chunk) == (int)chunk, "fs_read");
+		check_data(read_buffer, offset, chunk);
+	}
+	fs_close(fd);
+	return reads;
+}
+
+// keeps a window of small files, every step creates one file and unlinks the oldest one
+size_t bench_churn()
+{
+	size_t window = file_count / 4 + 1;
+	char path[MAX_PATH];
+	for (size_t i = 0; i < window; i++)
+	{
+		file_path(path, "/c", i);
+		make_file(path, 1 + random_next() % 2048);
+	}
+	bench_start();
+	for (size_t i = window; i < window + file_count; i++)
+	{
+		file_path(path, "/c", i);
+		make_file(path, 1 + random_next() % 2048);
+		file_path(path, "/c", i - window);
+		check(fs_unlink(path) == OK, "fs_unlink");
+	}
+	return 2 * file_count;
+}
+
+// stats random paths in a few directories, every eighth of them does not exist
+size_t bench_stat()
+{
+	size_t dirs = 8;
+	char path[MAX_PATH];
+	for (size_t d = 0; d < dirs; d++)
+	{
+		file_path(path, "/d", d);
+		check(fs_mkdir(path) == OK, "fs_mkdir");
+	}
+	for (size_t i = 0; i < file_count; i++)
+	{
+		snprintf(path, MAX_PATH, "/d%zu/f%zu", i % dirs, i);
+		make_file(path, 16);
+	}
+	bench_start();
+	size_t stats = 10 * file_count;
+	for (size_t i = 0; i < stats; i++)
+	{
+		size_t file = random_next() % file_count;
+		int missing = random_next() % 8 == 0;
+		snprintf(path, MAX_PATH, "/d%zu/%s%zu", file % dirs, missing ? "m" : "f", file);
+		struct fs_stat stat;
+		check((fs_stat(path, &stat) == OK) != missing, "fs_stat");
+	}
+	return stats;
+}
+
+// read throughput of sequential and random access for a few sizes of reads
+size_t bench_read()
+{
+	make_file("/large", large_file_size);
+	bench_start();
+	size_t chunks[] = {128, 1024, 4096, 65536};
+	size_t ops = 0;
+	printf("%-10s %8s %10s %12s\n", "pattern", "chunk", "MB/s", "reads/KiB");
+	for (int random = 0; random <= 1; random++)
+	{
+		for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++)
+		{
+			size_t chunk = chunks[c];
+			// every random read walks the chain to its offset, so only a part of the file is read
+			size_t bytes = random ? large_file_size / 16 : large_file_size;
+			if (chunk > bytes)
+			{
+				printf("%-10s %8zu %10s %12s\n", random ? "random" : "sequential", chunk, "skipped", "file too small");
+				continue;
+			}
+			file_t *fd = fs_open("/large");
+			check(fd != NULL, "fs_open");
+			uint64_t reads = disk_reads;
+			uint64_t start = now_ns();
+			for (size_t done = 0; done + chunk <= bytes; done += chunk)
+			{
+				size_t offset = done;
+				if (random)
+				{
+					offset = random_next() % (large_file_size - chunk);
+					check(fs_seek(fd, offset) == OK, "fs_seek");
+				}
+				check(fs_read(fd, read_buffer, chunk) == (int)chunk, "fs_read");
+				check_data(read_buffer, offset, chunk);
+				ops++;
+			}
+			double seconds = (now_ns() - start) / 1e9;
+			fs_close(fd);
+			printf("%-10s %8zu %10.2f %12.2f\n", random ? "random" : "sequential", chunk, bytes / seconds / 1e6,
+				   (double)(disk_reads - reads) / (bytes >> 10));
+		}
+	}
+	return ops;
+}
+
+typedef struct
+{
+	size_t thread;
+	size_t threads;
+	int write;
+} thread_work_t;
+
+#define BENCH_THREADS 8
+#define THREAD_CHUNK 4096
+
+// the large file is split into parts, one for each of the most threads, a thread reads or writes every part
+// with its number modulo number of threads, parts are separate files, so that reaching a part does not walk
+// the chain of the previous ones
+size_t thread_part_size()
+{
+	return large_file_size / BENCH_THREADS / THREAD_CHUNK * THREAD_CHUNK;
+}
+
+void *thread_main(void *arg)
+{
+	thread_work_t *work = arg;
+	uint8_t *data = malloc(THREAD_CHUNK);
+	check(data != NULL, "malloc");
+	for (size_t p = work->thread; p < BENCH_THREADS; p += work->threads)
+	{
+		char path[MAX_PATH];
+		file_path(path, work->write ? "/w" : "/r", p);
+		file_t *fd = work->write ? fs_creat(path) : fs_open(path);
+		check(fd != NULL, work->write ? "fs_creat" : "fs_open");
+		for (size_t done = 0; done < thread_part_size(); done += THREAD_CHUNK)
+		{
+			if (work->write)
+				check(fs_write(fd, buffer + done, THREAD_CHUNK) == THREAD_CHUNK, "fs_write");
+			else
+			{
+				check(fs_read(fd, data, THREAD_CHUNK) == THREAD_CHUNK, "fs_read");
+				check_data(data, done, THREAD_CHUNK);
+			}
+		}
+		fs_close(fd);
+	}
+	free(data);
+	return NULL;
+}
+
+// the same amount of data is read and written by 1 to 8 threads
+size_t bench_threads()
+{
+	// written files are removed after every round, so they always reuse freed sectors, the first round too
+	char path[MAX_PATH];
+	for (size_t p = 0; p < BENCH_THREADS; p++)
+	{
+		file_path(path, "/r", p);
+		make_file(path, thread_part_size());
+		file_path(path, "/w", p);
+		make_file(path, thread_part_size());
+	}
+	for (size_t p = 0; p < BENCH_THREADS; p++)
+	{
+		file_path(path, "/w", p);
+		check(fs_unlink(path) == OK, "fs_unlink");
+	}
+	bench_start();
+	size_t ops = 0;
+	double base[2] = {0, 0};
+	printf("%-8s %-6s %10s %8s\n", "threads", "op", "MB/s", "speedup");
+	for (size_t threads = 1; threads <= BENCH_THREADS; threads *= 2)
+	{
+		for (int write = 0; write <= 1; write++)
+		{
+			pthread_t ids[BENCH_THREADS];
+			thread_work_t work[BENCH_THREADS];
+			uint64_t start = now_ns();
+			for (size_t t = 0; t < threads; t++)
+			{
+				work[t] = (thread_work_t){t, threads, write};
+				check(pthread_create(&ids[t], NULL, thread_main, &work[t]) == 0, "pthread_create");
+			}
+			for (size_t t = 0; t < threads; t++)
+				pthread_join(ids[t], NULL);
+			double seconds = (now_ns() - start) / 1e9;
+			double rate = BENCH_THREADS * thread_part_size() / seconds / 1e6;
+			if (threads == 1)
+				base[write] = rate;
+			printf("%-8zu %-6s %10.2f %8.2f\n", threads, write ? "write" : "read", rate, rate / base[write]);
+			ops += BENCH_THREADS * thread_part_size() / THREAD_CHUNK;
+
+			for (size_t p = 0; write && p < BENCH_THREADS; p++)
+			{
+				file_path(path, "/w", p);
+				check(fs_unlink(path) == OK, "fs_unlink");
+			}
+		}
+	}
+	return ops;
+}
+
+typedef struct
+{
+	const char *name;
+	size_t (*run)();
+} workload_t;
+
+workload_t workloads[] = {
+	{"create", bench_create},
+	{"seqwrite", bench_seqwrite},
+	{"seqread", bench_seqread},
+	{"randread", bench_randread},
+	{"churn", bench_churn},
+	{"stat", bench_stat},
+	{"read", bench_read},
+	{"threads", bench_threads},
+};
+#define WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+void run_workload(const workload_t *workload)
+{
+	memset(disk, 0, disk_sectors * SECTOR_SIZE);
+	fs_format();
+	random_state = 1;
+	size_t ops = workload->run();
+	fs_sync();
+	double seconds = (now_ns() - bench_start_ns) / 1e9;
+	printf("== %s: %zu ops in %.3f s, %.0f ops/s\n", workload->name, ops, seconds, ops / seconds);
+	fs_io_stats_print();
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	size_t disk_mib = 64;
+	int i = 1;
+	for (; i + 1 < argc && argv[i][0] == '-'; i += 2)
+	{
+		long value = atol(argv[i + 1]);
+		if (strcmp(argv[i], "-d") == 0)
+			disk_mib = value;
+		else if (strcmp(argv[i], "-n") == 0)
+			file_count = value;
+		else if (strcmp(argv[i], "-s") == 0)
+			large_file_size = (size_t)value << 10;
+		else if (strcmp(argv[i], "-l") == 0)
+			device_latency_us = value;
+		else
+			break;
+	}
+	if (i < argc && argv[i][0] == '-')
+	{
+		fprintf(stderr, "usage: %s [-d disk MiB] [-n files] [-s large file KiB] [-l device latency us] [workload ...]\n", argv[0]);
+		return 1;
+	}
+
+	disk_sectors = (disk_mib << 20) / SECTOR_SIZE;
+	disk = malloc(disk_sectors * SECTOR_SIZE);
+	buffer = malloc(large_file_size);
+	read_buffer = malloc(large_file_size);
+	check(disk != NULL && buffer != NULL && read_buffer != NULL, "malloc");
+	for (size_t b = 0; b < large_file_size; b++)
+		buffer[b] = (uint8_t)random_next();
+
+	for (size_t w = 0; w < WORKLOADS; w++)
+	{
+		int selected = i == argc;
+		for (int a = i; a < argc; a++)
+			selected |= strcmp(argv[a], workloads[w].name) == 0;
+		if (selected)
+			run_workload(&workloads[w]);
+	}
+	return 0;
+}
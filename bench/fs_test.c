@@ -0,0 +1,877 @@
+// behavioral tests for filesystem.c, they run against a disk image kept in memory and check every structure on it,
+// so filesystem.c is included instead of linked, every test runs in its own process on a freshly formatted disk
+//
+// build: cc -g -I<directory with filesystem.h and util.h> bench/fs_test.c -lpthread -o fs_test
+// usage: fs_test [-d disk KiB] [test ...]
+
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "../filesystem.c"
+
+#define CRASHED 3 // exit status of a process which ran out of its writes
+#define TEST_FILE_MAX (64 * SECTOR_SIZE)
+
+uint8_t *disk_image = NULL; // shared with child processes, so that the disk left by a crash can be checked by another one
+size_t disk_sectors = 0;
+long write_budget = -1; // writes left before the process crashes, -1 for no crash
+
+uint8_t expected[TEST_FILE_MAX];
+uint8_t got[TEST_FILE_MAX + 1];
+
+// in-memory disk
+
+void hdd_read(size_t sector, void *buffer)
+{
+	if (sector >= disk_sectors)
+	{
+		fprintf(stderr, "read of sector %zu out of disk\n", sector);
+		exit(1);
+	}
+	memcpy(buffer, disk_image + sector * SECTOR_SIZE, SECTOR_SIZE);
+}
+
+void hdd_write(size_t sector, const void *buffer)
+{
+	if (sector >= disk_sectors)
+	{
+		fprintf(stderr, "write of sector %zu out of disk\n", sector);
+		exit(1);
+	}
+	// power is lost before the write, nothing that the process has in memory survives
+	if (write_budget == 0)
+		_exit(CRASHED);
+	if (write_budget > 0)
+		write_budget--;
+	memcpy(disk_image + sector * SECTOR_SIZE, buffer, SECTOR_SIZE);
+}
+
+size_t hdd_size()
+{
+	return disk_sectors * SECTOR_SIZE;
+}
+
+file_t *fd_alloc()
+{
+	return calloc(1, sizeof(file_t));
+}
+
+void fd_free(file_t *fd)
+{
+	free(fd);
+}
+
+// helpers
+
+void fail(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+void check(int ok, const char *what)
+{
+	if (!ok)
+		fail("%s failed", what);
+}
+
+// random numbers do not depend on the C library, so failures can be repeated on other machines
+uint64_t random_state = 1;
+
+uint64_t random_next()
+{
+	random_state = random_state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return random_state >> 33;
+}
+
+void format_disk()
+{
+	memset(disk_image, 0, disk_sectors * SECTOR_SIZE);
+	fs_format();
+}
+
+// data of every file are given by its seed, so that they differ between files and versions of one file
+void fill_data(uint8_t *data, size_t offset, size_t size, uint32_t seed)
+{
+	for (size_t i = 0; i < size; i++)
+		data[i] = (uint8_t)(seed * 131 + (offset + i) * 7 + (offset + i) / 251);
+}
+
+void make_file(const char *path, size_t size, uint32_t seed)
+{
+	file_t *fd = fs_creat(path);
+	check(fd != NULL, "fs_creat");
+	fill_data(expected, 0, size, seed);
+	check(fs_write(fd, expected, size) == (int)size, "fs_write");
+	fs_close(fd);
+}
+
+// file has to contain exactly 'size' bytes of data given by 'seed'
+void expect_file(const char *path, size_t size, uint32_t seed)
+{
+	file_t *fd = fs_open(path);
+	if (fd == NULL)
+		fail("%s is missing", path);
+	int length = fs_read(fd, got, size + 1);
+	fs_close(fd);
+	fill_data(expected, 0, size, seed);
+	if (length != (int)size || memcmp(got, expected, size) != 0)
+		fail("%s has %d bytes, expected %zu, or its data differ", path, length, size);
+}
+
+// processes
+
+// runs 'run' in a child process, which starts with the state of filesystem.c this process has, returns its exit status
+int run_child(void (*run)())
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	check(pid >= 0, "fork");
+	if (pid == 0)
+	{
+		run();
+		exit(0);
+	}
+	int status = 0;
+	check(waitpid(pid, &status, 0) == pid, "waitpid");
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+// disk checker, every sector below the high-water mark has to be free or used by exactly one structure, data sectors
+// shared by clones are used once, but linked as many times as their reference count says
+
+const char **sector_owners = NULL; // what every sector is used for, NULL if nothing uses it
+uint32_t *sector_links = NULL;	   // links to every data sector
+uint32_t *slots_seen = NULL;	   // slots of every packed sector which directory entries refer to
+uint32_t checked_sectors = 0;
+
+void claim(uint32_t addr, const char *owner)
+{
+	if (addr == 0 || addr >= checked_sectors)
+		fail("%s sector %u is out of the used part of the disk", owner, addr);
+	if (sector_owners[addr] != NULL)
+		fail("sector %u is used as %s and as %s", addr, sector_owners[addr], owner);
+	sector_owners[addr] = owner;
+}
+
+// every link to a chain is counted, but only the first one walks it, as the rest of a shared chain is shared too
+void check_chain(uint32_t addr)
+{
+	while (addr != 0)
+	{
+		if (addr >= checked_sectors)
+			fail("data sector %u is out of the used part of the disk", addr);
+		sector_links[addr]++;
+		if (sector_owners[addr] != NULL)
+		{
+			if (strcmp(sector_owners[addr], "data") != 0)
+				fail("sector %u is used as %s and as data", addr, sector_owners[addr]);
+			return;
+		}
+		claim(addr, "data");
+		uint8_t data_buffer[SECTOR_SIZE] = {0};
+		disk_read(addr, data_buffer);
+		addr = ((data_sector_t *)data_buffer)->next_data_sector_addr;
+	}
+}
+
+void check_file(const file_sector_t *file)
+{
+	uint8_t copies_buffer[SECTOR_SIZE] = {0};
+	copies_sector_t *copies = (copies_sector_t *)copies_buffer;
+	if (file->copies_sector_addr != 0)
+	{
+		claim(file->copies_sector_addr, "copies");
+		disk_read(file->copies_sector_addr, copies_buffer);
+		if (!(file->flags & FILE_FLAG_SHARED) || copies->count > SECTOR_COPIES)
+			fail("copies sector %u does not belong to a shared file", file->copies_sector_addr);
+	}
+	check_chain(file->first_data_sector_addr);
+	for (uint32_t i = 0; i < copies->count; i++)
+		check_chain(copies->copies[i].copy_addr);
+
+	// chain of the file continues through copies of shared sectors, it ends with the sector holding its last byte
+	uint32_t last_addr = 0;
+	uint32_t last_order = 0;
+	uint32_t addr = copied_sector(copies, file->first_data_sector_addr);
+	while (addr != 0)
+	{
+		uint8_t data_buffer[SECTOR_SIZE] = {0};
+		disk_read(addr, data_buffer);
+		data_sector_t *data = (data_sector_t *)data_buffer;
+		if (last_addr != 0 && data->order <= last_order)
+			fail("data sector %u has order %u after order %u", addr, data->order, last_order);
+		last_addr = addr;
+		last_order = data->order;
+		addr = copied_sector(copies, data->next_data_sector_addr);
+	}
+	if (last_addr != file->last_data_sector_addr)
+		fail("chain ends with sector %u, header says %u", last_addr, file->last_data_sector_addr);
+	uint32_t count = data_sectors_count(file->size);
+	if (count == 0 ? last_addr != 0 : last_addr == 0 || last_order + 1 != count)
+		fail("file of %u bytes ends with data sector of order %u", file->size, last_order);
+}
+
+void check_dir(const file_sector_t *dir);
+
+// walks subtree of directory entries, names have to grow through all leaves, which are linked in the same order
+void check_node(uint32_t node_addr, uint32_t *prev_leaf_addr, uint32_t *entries, char *last_name)
+{
+	claim(node_addr, "directory node");
+	uint8_t node_buffer[SECTOR_SIZE] = {0};
+	disk_read(node_addr, node_buffer);
+	btree_leaf_t *leaf = (btree_leaf_t *)node_buffer;
+	if (!leaf->leaf)
+	{
+		btree_inner_t *inner = (btree_inner_t *)node_buffer;
+		for (uint32_t i = 0; i <= inner->count; i++)
+			check_node(inner->children[i], prev_leaf_addr, entries, last_name);
+		return;
+	}
+
+	if (leaf->count == 0)
+		fail("leaf %u is empty", node_addr);
+	if (*prev_leaf_addr != 0)
+	{
+		uint8_t prev_buffer[SECTOR_SIZE] = {0};
+		disk_read(*prev_leaf_addr, prev_buffer);
+		if (((btree_leaf_t *)prev_buffer)->next_leaf_addr != node_addr)
+			fail("leaf %u is not linked to the next leaf %u", *prev_leaf_addr, node_addr);
+	}
+	*prev_leaf_addr = node_addr;
+
+	for (uint32_t i = 0; i < leaf->count; i++)
+	{
+		dir_entry_t *entry = &leaf->entries[i];
+		if (*entries > 0 && strncmp(last_name, entry->name, MAX_FILENAME) >= 0)
+			fail("entry %.*s follows %.*s", MAX_FILENAME, entry->name, MAX_FILENAME, last_name);
+		memcpy(last_name, entry->name, MAX_FILENAME);
+		(*entries)++;
+
+		uint32_t file_addr = entry->file_sector_addr;
+		if (file_addr & PACKED_FILE)
+		{
+			uint32_t sector_addr = packed_sector_addr(file_addr);
+			uint32_t slot = 1u << packed_slot_index(file_addr);
+			if (sector_owners[sector_addr] == NULL)
+				claim(sector_addr, "packed");
+			if (strcmp(sector_owners[sector_addr], "packed") != 0 || (slots_seen[sector_addr] & slot))
+				fail("entry %.*s refers to a slot in sector %u, which is used already", MAX_FILENAME, entry->name,
+					 sector_addr);
+			slots_seen[sector_addr] |= slot;
+		}
+		else
+		{
+			claim(file_addr, "header");
+		}
+
+		uint8_t header_buffer[SECTOR_SIZE] = {0};
+		uint32_t header_addr = load_header(file_addr, header_buffer);
+		if (header_addr != file_addr)
+			claim(header_addr, "header");
+		file_sector_t *file = (file_sector_t *)header_buffer;
+		if (file->type == STAT_TYPE_DIR)
+			check_dir(file);
+		else if (file->type == STAT_TYPE_FILE)
+			check_file(file);
+		else
+			fail("entry %.*s has type %u", MAX_FILENAME, entry->name, file->type);
+	}
+}
+
+void check_dir(const file_sector_t *dir)
+{
+	uint32_t prev_leaf_addr = 0;
+	uint32_t entries = 0;
+	char last_name[MAX_FILENAME] = {0};
+	if (dir->first_data_sector_addr != 0)
+		check_node(dir->first_data_sector_addr, &prev_leaf_addr, &entries, last_name);
+	if (entries != dir->size)
+		fail("directory of %u entries has %u", dir->size, entries);
+	if (prev_leaf_addr != 0)
+	{
+		uint8_t leaf_buffer[SECTOR_SIZE] = {0};
+		disk_read(prev_leaf_addr, leaf_buffer);
+		if (((btree_leaf_t *)leaf_buffer)->next_leaf_addr != 0)
+			fail("last leaf %u is linked further", prev_leaf_addr);
+	}
+}
+
+void check_disk()
+{
+	uint8_t fs_buffer[SECTOR_SIZE] = {0};
+	load_metadata(fs_buffer);
+	fs_metadata_t *fs_metadata = (fs_metadata_t *)fs_buffer;
+	checked_sectors = fs_metadata->next_unused_sector_addr;
+	check(checked_sectors <= disk_sectors, "high-water mark");
+	sector_owners = calloc(checked_sectors, sizeof(const char *));
+	sector_links = calloc(checked_sectors, sizeof(uint32_t));
+	slots_seen = calloc(checked_sectors, sizeof(uint32_t));
+	check(sector_owners != NULL && sector_links != NULL && slots_seen != NULL, "calloc");
+
+	sector_owners[FS_METADATA_SECTOR] = "metadata";
+	for (uint32_t addr = FS_JOURNAL_SECTOR; addr < FS_JOURNAL_SECTOR + JOURNAL_DESCRIPTOR_SECTORS + JOURNAL_CAPACITY; addr++)
+		claim(addr, "journal");
+	for (uint32_t addr = fs_metadata->first_free_sector_addr; addr != 0;)
+	{
+		claim(addr, "free");
+		uint8_t free_buffer[SECTOR_SIZE] = {0};
+		disk_read(addr, free_buffer);
+		addr = ((free_sector_t *)free_buffer)->next_free_sector_addr;
+	}
+	check(fs_metadata->data_pool_count <= DATA_POOL_SECTORS, "data pool size");
+	for (uint32_t i = 0; i < fs_metadata->data_pool_count; i++)
+		claim(fs_metadata->data_pool[i], "pool");
+
+	claim(fs_metadata->root_dir_sector_addr, "header");
+	uint8_t root_buffer[SECTOR_SIZE] = {0};
+	disk_read(fs_metadata->root_dir_sector_addr, root_buffer);
+	check_dir((file_sector_t *)root_buffer);
+
+	// sectors in the list of packed sectors have free slots and some used ones, other packed sectors are full
+	for (uint32_t addr = fs_metadata->first_packed_sector_addr; addr != 0;)
+	{
+		if (addr >= checked_sectors || sector_owners[addr] == NULL || strcmp(sector_owners[addr], "packed") != 0 ||
+			sector_links[addr] != 0)
+			fail("sector %u in the list of packed sectors is not a used packed sector, or it is there twice", addr);
+		sector_links[addr] = 1;
+		uint8_t packed_buffer[SECTOR_SIZE] = {0};
+		disk_read(addr, packed_buffer);
+		addr = ((packed_sector_t *)packed_buffer)->next_packed_sector_addr;
+	}
+
+	for (uint32_t addr = 0; addr < checked_sectors; addr++)
+	{
+		if (sector_owners[addr] == NULL)
+			fail("sector %u is neither used nor free", addr);
+		uint8_t buffer[SECTOR_SIZE] = {0};
+		if (strcmp(sector_owners[addr], "data") == 0)
+		{
+			disk_read(addr, buffer);
+			if (((data_sector_t *)buffer)->refs != sector_links[addr])
+				fail("data sector %u has %u references and %u links", addr, ((data_sector_t *)buffer)->refs,
+					 sector_links[addr]);
+		}
+		if (strcmp(sector_owners[addr], "packed") == 0)
+		{
+			disk_read(addr, buffer);
+			packed_sector_t *packed = (packed_sector_t *)buffer;
+			if (packed->used_slots != slots_seen[addr] || packed->listed != sector_links[addr])
+				fail("packed sector %u has slots %x used and %x referred to, listed %u", addr, packed->used_slots,
+					 slots_seen[addr], packed->listed);
+		}
+	}
+
+	free(sector_owners);
+	free(sector_links);
+	free(slots_seen);
+}
+
+// free sectors, including the never used ones and those in the data pool
+uint32_t free_sectors()
+{
+	uint8_t fs_buffer[SECTOR_SIZE] = {0};
+	load_metadata(fs_buffer);
+	fs_metadata_t *fs_metadata = (fs_metadata_t *)fs_buffer;
+	uint32_t count = disk_sectors - fs_metadata->next_unused_sector_addr + fs_metadata->data_pool_count;
+	for (uint32_t addr = fs_metadata->first_free_sector_addr; addr != 0; count++)
+	{
+		uint8_t free_buffer[SECTOR_SIZE] = {0};
+		disk_read(addr, free_buffer);
+		addr = ((free_sector_t *)free_buffer)->next_free_sector_addr;
+	}
+	return count;
+}
+
+// tests
+
+#define CRASH_PHASES 6
+#define CRASH_FILES 4
+
+long crash_writes = 0;
+long replay_writes = 0;
+volatile int *synced_phase = NULL; // last phase made durable by fs_sync before the crash, shared with child processes
+
+// sizes cover a file kept in a packed slot, one kept in its header and files with data sectors
+size_t crash_file_size(size_t phase, size_t i)
+{
+	size_t sizes[CRASH_FILES] = {8, FILE_SECTOR_DATA_SIZE / 2, 3 * SECTOR_SIZE, 12 * SECTOR_SIZE};
+	return sizes[i] + phase;
+}
+
+void crash_path(char *path, size_t phase, size_t i)
+{
+	snprintf(path, MAX_PATH, "/p%zu/f%zu", phase, i);
+}
+
+// every phase creates a directory with files and removes the directory of the phase before the previous one
+void crash_workload()
+{
+	format_disk();
+	write_budget = crash_writes;
+	char path[MAX_PATH];
+	for (size_t phase = 0; phase < CRASH_PHASES; phase++)
+	{
+		snprintf(path, MAX_PATH, "/p%zu", phase);
+		check(fs_mkdir(path) == OK, "fs_mkdir");
+		for (size_t i = 0; i < CRASH_FILES; i++)
+		{
+			crash_path(path, phase, i);
+			make_file(path, crash_file_size(phase, i), phase * CRASH_FILES + i);
+		}
+		if (phase >= 2)
+		{
+			for (size_t i = 0; i < CRASH_FILES; i++)
+			{
+				crash_path(path, phase - 2, i);
+				check(fs_unlink(path) == OK, "fs_unlink");
+			}
+			snprintf(path, MAX_PATH, "/p%zu", phase - 2);
+			check(fs_rmdir(path) == OK, "fs_rmdir");
+		}
+		fs_sync();
+		*synced_phase = phase;
+	}
+}
+
+void crash_replay()
+{
+	write_budget = replay_writes;
+	uint8_t fs_buffer[SECTOR_SIZE] = {0};
+	load_metadata(fs_buffer);
+}
+
+// everything synced before the crash is there, files of later phases exist only with a prefix of their data, and
+// the disk can be used further
+void crash_check()
+{
+	check_disk();
+	int synced = *synced_phase;
+	char path[MAX_PATH];
+	for (int phase = 0; phase < CRASH_PHASES; phase++)
+	{
+		for (size_t i = 0; i < CRASH_FILES; i++)
+		{
+			crash_path(path, phase, i);
+			size_t size = crash_file_size(phase, i);
+			struct fs_stat file_stat;
+			int exists = fs_stat(path, &file_stat) == OK;
+			if ((phase <= synced - 2 && exists) || (phase == synced && !exists))
+				fail("%s exists %d after phase %d was synced", path, exists, synced);
+			if (!exists)
+				continue;
+			if (file_stat.st_size > size || (phase <= synced && file_stat.st_size != size))
+				fail("%s has %zu bytes after phase %d was synced", path, (size_t)file_stat.st_size, synced);
+			expect_file(path, file_stat.st_size, phase * CRASH_FILES + i);
+		}
+	}
+	make_file("/after", 5 * SECTOR_SIZE, 1);
+	expect_file("/after", 5 * SECTOR_SIZE, 1);
+	check_disk();
+}
+
+// the workload crashes before every one of its writes, the journal is replayed, which may crash as well before every
+// one of its writes, and then the disk is checked
+void test_crash()
+{
+	synced_phase = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	check(synced_phase != MAP_FAILED, "mmap");
+	size_t replays = 0;
+	for (crash_writes = 0;; crash_writes++)
+	{
+		*synced_phase = -1;
+		int status = run_child(crash_workload);
+		if (status != CRASHED)
+		{
+			check(status == 0 && *synced_phase == CRASH_PHASES - 1, "workload");
+			break;
+		}
+		for (replay_writes = 0; (status = run_child(crash_replay)) == CRASHED; replay_writes++)
+			replays++;
+		check(status == 0, "replay");
+		if (run_child(crash_check) != 0)
+			fail("check after crash before write %ld and %ld crashed replays failed", crash_writes, replay_writes);
+	}
+	check(run_child(crash_check) == 0, "check after the workload");
+	printf("%ld crash points, %zu crashed replays\n", crash_writes, replays);
+}
+
+#define DIR_NAMES 300
+
+void shuffle(size_t *items, size_t count)
+{
+	for (size_t i = count; i > 1; i--)
+	{
+		size_t j = random_next() % i;
+		size_t item = items[i - 1];
+		items[i - 1] = items[j];
+		items[j] = item;
+	}
+}
+
+void dir_path(char *path, size_t name)
+{
+	snprintf(path, MAX_PATH, "/d/n%zu", name);
+}
+
+// directory lists every present name once, in order of names
+void expect_names(const uint8_t *present)
+{
+	file_t *dir = fs_opendir("/d");
+	check(dir != NULL, "fs_opendir");
+	char item[MAX_FILENAME] = {0};
+	char last[MAX_FILENAME] = {0};
+	size_t listed = 0;
+	while (fs_readdir(dir, item) == OK)
+	{
+		size_t name = atol(item + 1);
+		if (item[0] != 'n' || name >= DIR_NAMES || !present[name] || (listed > 0 && strcmp(last, item) >= 0))
+			fail("readdir returned %s after %s", item, last);
+		memcpy(last, item, MAX_FILENAME);
+		listed++;
+	}
+	fs_closedir(dir);
+	size_t count = 0;
+	for (size_t name = 0; name < DIR_NAMES; name++)
+		count += present[name];
+	if (listed != count)
+		fail("readdir returned %zu of %zu names", listed, count);
+}
+
+// names are inserted and removed in random order, so that leaves and inner nodes of the directory split and merge,
+// reading the directory between the changes neither repeats nor skips the names which stay in it
+void test_dir()
+{
+	format_disk();
+	check(fs_mkdir("/d") == OK, "fs_mkdir");
+	uint32_t free_start = free_sectors();
+	uint8_t present[DIR_NAMES] = {0};
+	size_t order[DIR_NAMES];
+	char path[MAX_PATH];
+	for (size_t i = 0; i < DIR_NAMES; i++)
+		order[i] = i;
+
+	// the first half is inserted at once, the second one while the directory is being read
+	shuffle(order, DIR_NAMES);
+	for (size_t i = 0; i < DIR_NAMES / 2; i++)
+	{
+		dir_path(path, order[i]);
+		make_file(path, order[i] % 4 == 0 ? 2 * SECTOR_SIZE : 4, order[i]);
+		present[order[i]] = 1;
+		if (i % 16 == 0)
+			check_disk();
+	}
+	check_disk();
+	expect_names(present);
+
+	file_t *dir = fs_opendir("/d");
+	check(dir != NULL, "fs_opendir");
+	char item[MAX_FILENAME] = {0};
+	char last[MAX_FILENAME] = {0};
+	size_t listed = 0;
+	uint8_t returned[DIR_NAMES] = {0};
+	for (size_t i = DIR_NAMES / 2; i < DIR_NAMES || listed > 0; i++)
+	{
+		if (i < DIR_NAMES)
+		{
+			dir_path(path, order[i]);
+			make_file(path, 4, order[i]);
+		}
+		if (fs_readdir(dir, item) != OK)
+			break;
+		size_t name = atol(item + 1);
+		if (name >= DIR_NAMES || returned[name] || (listed > 0 && strcmp(last, item) >= 0))
+			fail("readdir returned %s after %s", item, last);
+		returned[name] = 1;
+		memcpy(last, item, MAX_FILENAME);
+		listed++;
+	}
+	fs_closedir(dir);
+	for (size_t name = 0; name < DIR_NAMES; name++)
+	{
+		if (present[name] && !returned[name])
+			fail("readdir skipped n%zu", name);
+		present[name] = 1;
+	}
+	check_disk();
+	expect_names(present);
+
+	// removing every name checks merges down to the empty directory, half of them is inserted back in the middle
+	shuffle(order, DIR_NAMES);
+	for (size_t i = 0; i < DIR_NAMES; i++)
+	{
+		dir_path(path, order[i]);
+		check(fs_unlink(path) == OK, "fs_unlink");
+		present[order[i]] = 0;
+		if (i == DIR_NAMES / 2)
+		{
+			for (size_t j = 0; j < i; j += 2)
+			{
+				dir_path(path, order[j]);
+				make_file(path, 4, order[j]);
+				present[order[j]] = 1;
+			}
+			check_disk();
+			expect_names(present);
+			for (size_t j = 0; j < i; j += 2)
+			{
+				dir_path(path, order[j]);
+				check(fs_unlink(path) == OK, "fs_unlink");
+				present[order[j]] = 0;
+			}
+		}
+		if (i % 16 == 0)
+		{
+			check_disk();
+			expect_names(present);
+		}
+	}
+	check_disk();
+	expect_names(present);
+	if (free_sectors() != free_start)
+		fail("%u free sectors after all names were removed, %u before", free_sectors(), free_start);
+	check(fs_rmdir("/d") == OK, "fs_rmdir");
+	check_disk();
+}
+
+#define PACK_FILES (4 * PACKED_SLOTS)
+#define PACK_ROUNDS 8
+
+// small files share packed sectors, emptied sectors are freed, a growing file moves out of its slot to its own
+// header and then to data sectors, while its handles and the other files of the sector stay valid
+void test_pack()
+{
+	format_disk();
+	uint32_t free_start = free_sectors();
+	size_t order[PACK_FILES];
+	char path[MAX_PATH];
+	for (size_t i = 0; i < PACK_FILES; i++)
+		order[i] = i;
+	for (size_t round = 0; round < PACK_ROUNDS; round++)
+	{
+		for (size_t i = 0; i < PACK_FILES; i++)
+		{
+			snprintf(path, MAX_PATH, "/s%zu", i);
+			make_file(path, 1 + (i + round) % 24, round * PACK_FILES + i);
+		}
+		check_disk();
+		// random order empties some packed sectors while others are partly used and listed
+		shuffle(order, PACK_FILES);
+		for (size_t i = 0; i < PACK_FILES; i++)
+		{
+			snprintf(path, MAX_PATH, "/s%zu", order[i]);
+			check(fs_unlink(path) == OK, "fs_unlink");
+			if (i % 8 == 0)
+				check_disk();
+		}
+		check_disk();
+		if (free_sectors() != free_start)
+			fail("%u free sectors after round %zu, %u before", free_sectors(), round, free_start);
+	}
+
+	make_file("/a", 10, 1);
+	make_file("/b", 10, 2);
+	make_file("/c", 10, 3);
+	file_t *reader = fs_open("/b");
+	file_t *writer = fs_open("/b");
+	check(reader != NULL && writer != NULL, "fs_open");
+	size_t size = 10;
+	while (size < 20 * SECTOR_SIZE)
+	{
+		size_t step = size / 2 + 1;
+		fill_data(expected, size, step, 2);
+		check(fs_seek(writer, size) == OK, "fs_seek");
+		check(fs_write(writer, expected, step) == (int)step, "fs_write");
+		size += step;
+		check_disk();
+		expect_file("/b", size, 2);
+		check(fs_seek(reader, 0) == OK, "fs_seek");
+		check(fs_read(reader, got, size + 1) == (int)size, "fs_read of the moved file");
+		fill_data(expected, 0, size, 2);
+		check(memcmp(got, expected, size) == 0, "data of the moved file");
+		expect_file("/a", 10, 1);
+		expect_file("/c", 10, 3);
+	}
+
+	// truncated file is small again
+	make_file("/b", 6, 4);
+	check(fs_seek(reader, 0) == OK, "fs_seek");
+	check(fs_read(reader, got, TEST_FILE_MAX) == 6 && memcmp(got, expected, 6) == 0, "fs_read of the truncated file");
+	fs_close(reader);
+	fs_close(writer);
+	check_disk();
+	check(fs_unlink("/a") == OK && fs_unlink("/b") == OK && fs_unlink("/c") == OK, "fs_unlink");
+	check_disk();
+	if (free_sectors() != free_start)
+		fail("%u free sectors after the files moved and were removed, %u before", free_sectors(), free_start);
+}
+
+// expected contents of a file
+typedef struct
+{
+	const char *path;
+	size_t size;
+	uint8_t data[TEST_FILE_MAX];
+} model_file_t;
+
+model_file_t models[5];
+
+void model_write(model_file_t *model, size_t offset, size_t size, uint32_t seed)
+{
+	file_t *fd = fs_open(model->path);
+	check(fd != NULL, "fs_open");
+	fill_data(model->data + offset, offset, size, seed);
+	check(fs_seek(fd, offset) == OK, "fs_seek");
+	check(fs_write(fd, model->data + offset, size) == (int)size, "fs_write");
+	fs_close(fd);
+	if (offset + size > model->size)
+		model->size = offset + size;
+}
+
+void model_clone(model_file_t *model, const model_file_t *src, const char *path)
+{
+	check(fs_clone(src->path, path) == OK, "fs_clone");
+	model->path = path;
+	model->size = src->size;
+	memcpy(model->data, src->data, src->size);
+}
+
+// every live model matches its file
+void expect_models()
+{
+	for (size_t m = 0; m < sizeof(models) / sizeof(models[0]); m++)
+	{
+		if (models[m].path == NULL)
+			continue;
+		file_t *fd = fs_open(models[m].path);
+		check(fd != NULL, "fs_open");
+		int length = fs_read(fd, got, TEST_FILE_MAX + 1);
+		fs_close(fd);
+		if (length != (int)models[m].size || memcmp(got, models[m].data, models[m].size) != 0)
+			fail("%s has %d bytes, expected %zu, or its data differ", models[m].path, length, models[m].size);
+	}
+	check_disk();
+}
+
+void model_unlink(model_file_t *model)
+{
+	check(fs_unlink(model->path) == OK, "fs_unlink");
+	model->path = NULL;
+}
+
+// clones share data sectors of their source and writes copy only the sectors they change, check_disk compares
+// reference counts with links after every step, so the last file removed frees all shared sectors
+void test_clone()
+{
+	format_disk();
+	uint32_t free_start = free_sectors();
+	model_file_t *src = &models[0];
+	model_file_t *first = &models[1];
+	model_file_t *second = &models[2];
+	model_file_t *third = &models[3];
+	model_file_t *small = &models[4];
+
+	src->path = "/src";
+	make_file(src->path, 0, 0);
+	model_write(src, 0, 24 * SECTOR_SIZE, 1);
+	model_clone(first, src, "/c1");
+	model_clone(second, first, "/c2");
+	expect_models();
+
+	// a write into the middle of the shared chain, to its start, and behind its end
+	model_write(first, 5 * SECTOR_SIZE + 3, 2 * SECTOR_SIZE, 2);
+	expect_models();
+	model_write(src, 0, 10, 3);
+	expect_models();
+	model_write(second, second->size, 3 * SECTOR_SIZE, 4);
+	expect_models();
+
+	// scattered writes make more copies than one copies sector holds
+	model_clone(third, first, "/c3");
+	for (size_t i = 1; i < 22; i += 2)
+	{
+		model_write(third, i * SECTOR_SIZE + 1, 1, 5 + i);
+		expect_models();
+	}
+
+	model_unlink(src);
+	expect_models();
+	model_write(first, 0, first->size, 6);
+	expect_models();
+	model_unlink(second);
+	expect_models();
+	model_unlink(first);
+	expect_models();
+	model_unlink(third);
+	expect_models();
+
+	// header of a small file is in a packed slot, its clone gets its own
+	small->path = "/small";
+	make_file(small->path, 0, 0);
+	model_write(small, 0, 10, 7);
+	model_clone(first, small, "/small2");
+	model_write(first, 4, 4, 8);
+	expect_models();
+	model_unlink(small);
+	model_unlink(first);
+	expect_models();
+	if (free_sectors() != free_start)
+		fail("%u free sectors after all clones were removed, %u before", free_sectors(), free_start);
+}
+
+typedef struct
+{
+	const char *name;
+	void (*run)();
+} test_t;
+
+test_t tests[] = {
+	{"crash", test_crash},
+	{"dir", test_dir},
+	{"pack", test_pack},
+	{"clone", test_clone},
+};
+#define TESTS (sizeof(tests) / sizeof(tests[0]))
+
+int main(int argc, char **argv)
+{
+	size_t disk_kib = 256;
+	int i = 1;
+	for (; i + 1 < argc && argv[i][0] == '-'; i += 2)
+	{
+		if (strcmp(argv[i], "-d") == 0)
+			disk_kib = atol(argv[i + 1]);
+		else
+			break;
+	}
+	if (i < argc && argv[i][0] == '-')
+	{
+		fprintf(stderr, "usage: %s [-d disk KiB] [test ...]\n", argv[0]);
+		return 1;
+	}
+
+	// this process never touches the filesystem, so every test starts without anything cached
+	disk_sectors = (disk_kib << 10) / SECTOR_SIZE;
+	disk_image = mmap(NULL, disk_sectors * SECTOR_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	check(disk_image != MAP_FAILED, "mmap");
+	int failed = 0;
+	for (size_t t = 0; t < TESTS; t++)
+	{
+		int selected = i == argc;
+		for (int a = i; a < argc; a++)
+			selected |= strcmp(argv[a], tests[t].name) == 0;
+		if (!selected)
+			continue;
+		printf("== %s\n", tests[t].name);
+		int status = run_child(tests[t].run);
+		printf("%s\n\n", status == 0 ? "ok" : "FAILED");
+		failed |= status != 0;
+	}
+	return failed;
+}
@@ -1,38 +1,116 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #include "filesystem.h"
 #include "util.h"
 
 #define ADDR_SIZE 4
 #define FS_METADATA_SECTOR 0
-#define FILE_SECTOR_DATA_SIZE (SECTOR_SIZE - MAX_FILENAME - (4 * ADDR_SIZE))
-#define DATA_SECTOR_DATA_SIZE (SECTOR_SIZE - ADDR_SIZE)
+#define FS_JOURNAL_SECTOR 1 // descriptor of the last committed batch, followed by its sector images
+#define JOURNAL_CAPACITY 64 // max number of metadata sectors in one batch
+#define JOURNAL_DESCRIPTOR_SECTORS ((sizeof(journal_descriptor_t) + SECTOR_SIZE - 1) / SECTOR_SIZE)
+#define JOURNAL_BATCH_OPS 16 // operations grouped into one batch
+#define JOURNAL_BATCH_MS 1000 // batch is committed by the first operation which ends later than this after its first change
+#define JOURNAL_OP_SECTORS 40 // batch sectors reserved by operation changing directories
+#define JOURNAL_WRITE_SECTORS 12 // batch sectors reserved by one part of write, moving the header out of its slot and one step
+#define JOURNAL_STEP_SECTORS 8 // most batch sectors changed by one step of write, part of write ends before the step
+#define DATA_POOL_SECTORS (SECTOR_SIZE / ADDR_SIZE - 6)
+#define FILE_SECTOR_DATA_SIZE (SECTOR_SIZE - (7 * ADDR_SIZE))
+#define DATA_SECTOR_DATA_SIZE (SECTOR_SIZE - (3 * ADDR_SIZE))
+#define MAX_FILE_SIZE UINT32_MAX
 #define FILE_CURSOR 1
 #define FILE_ADDR 0
+#define FILE_GENERATION 2	  // generation of the file when its cursor sector was remembered
+#define FILE_CURSOR_SECTOR 3 // data sector containing cursor after sequential read, 0 if unknown
+#define CACHE_SECTORS 64
+#define DIR_CURSOR 1	   // cursor with name of the last read directory entry
+#define DIR_LEAF 2		   // leaf which contained the last read entry, 0 if unknown
+#define DIR_GENERATION 3 // generation of directory when its leaf was remembered
+#define BTREE_LEAF_ENTRIES ((SECTOR_SIZE - (3 * ADDR_SIZE)) / sizeof(dir_entry_t))
+#define BTREE_INNER_KEYS ((SECTOR_SIZE - (3 * ADDR_SIZE)) / (MAX_FILENAME + ADDR_SIZE))
+#define BTREE_MAX_HEIGHT 32 // tree grows only by splitting a full root, so it never gets higher
+#define FILE_FLAG_SHARED 1 // some data sectors of the file may be shared with its clones
+#define SECTOR_COPIES_FIT ((SECTOR_SIZE - ADDR_SIZE) / (2 * ADDR_SIZE))
+#define SECTOR_COPIES (SECTOR_COPIES_FIT < 8 ? SECTOR_COPIES_FIT : 8) // releasing them has to fit into one batch
+#define FILE_LOCKS 64 // file contents are protected by locks picked by address of the file header
+#define PACKED_LOCKS 16 // slots of packed sectors are protected by locks picked by address of the sector
+#define PACKED_FILE 0x80000000 // file address refers to a slot of packed sector instead of a whole sector
+#define PACKED_SLOTS_FIT ((SECTOR_SIZE - (3 * ADDR_SIZE)) / (sizeof(packed_slot_t) + ADDR_SIZE))
+#define PACKED_SLOTS (PACKED_SLOTS_FIT < 32 ? PACKED_SLOTS_FIT : 32) // used slots are kept in 32 bit mask
+#define PACKED_SLOT_MOVED 0x8000 // slot holds only address of the file sector its file moved to
+// operations with separate I/O statistics
+#define IO_OP_FORMAT 0
+#define IO_OP_CREAT 1
+#define IO_OP_OPEN 2
+#define IO_OP_UNLINK 3
+#define IO_OP_RENAME 4
+#define IO_OP_READ 5
+#define IO_OP_WRITE 6
+#define IO_OP_SEEK 7
+#define IO_OP_STAT 8
+#define IO_OP_MKDIR 9
+#define IO_OP_RMDIR 10
+#define IO_OP_OPENDIR 11
+#define IO_OP_READDIR 12
+#define IO_OP_SYNC 13
+#define IO_OP_CLONE 14
+#define IO_OP_CLOSE 15
+#define IO_OP_CLOSEDIR 16
+#define IO_OPS 17
+// counters kept for every operation
+#define IO_CALLS 0
+#define IO_SECTOR_READS 1
+#define IO_SECTOR_WRITES 2
+#define IO_BYTES_COPIED 3 // bytes copied between file and caller buffer
+#define IO_CHAIN_STEPS 4	// links followed to find a data sector or a directory entry
+#define IO_COUNTERS 5
 
 typedef struct
 {
 	uint32_t first_free_sector_addr;
-	uint32_t last_free_sector_addr;
-	uint32_t first_file_sector_addr;
-	uint32_t last_file_sector_addr;
+	// sectors at and above this address have never been used and are implicitly free
+	uint32_t next_unused_sector_addr;
+	uint32_t root_dir_sector_addr;
+	// list of packed sectors with at least one free slot
+	uint32_t first_packed_sector_addr;
+	// sequence number of the last journal batch written to its place
+	uint32_t checkpoint_seq;
+	// free sectors taken from the free list for file data, which is written directly to its place, once the batch
+	// which took them is committed, nothing needs their free list links anymore
+	uint32_t data_pool_count;
+	uint32_t data_pool[DATA_POOL_SECTORS];
 } fs_metadata_t;
 
 typedef struct
 {
-	char filename[MAX_FILENAME];
+	uint32_t type; // STAT_TYPE_FILE or STAT_TYPE_DIR
+	uint32_t flags;
+	// number of bytes in file, or number of entries in directory
 	uint32_t size;
-	uint32_t next_file_sector_addr;
+	// directory uses the first address for the root of its entry tree
 	uint32_t first_data_sector_addr;
 	uint32_t last_data_sector_addr;
+	// sector with copies of shared data sectors written by the file, 0 if there are none
+	uint32_t copies_sector_addr;
+	// changed whenever a data sector may stop being the one of its order, or for directory, whenever entries
+	// move to another leaf, so that handles know their cursor sector or leaf is not valid anymore
+	uint32_t generation;
 	char data[FILE_SECTOR_DATA_SIZE];
 } file_sector_t;
 
 typedef struct
 {
 	uint32_t next_data_sector_addr;
+	// order of the sector in file data, chain is sorted by it and missing orders are holes read as zeros
+	uint32_t order;
+	// number of file headers, data sectors and copies sectors linking to this sector, sector is shared by clones when
+	// it is higher than 1, the rest of the chain is then shared too
+	uint32_t refs;
 	char data[DATA_SECTOR_DATA_SIZE];
 } data_sector_t;
 
@@ -41,208 +119,1762 @@ typedef struct
 	uint32_t next_free_sector_addr;
 } free_sector_t;
 
+typedef struct
+{
+	uint32_t shared_addr;
+	uint32_t copy_addr;
+} sector_copy_t;
+
+// data sectors which the file copied, because they were shared with clones, but the sector linked before them was shared
+// too, so it could not be relinked, chain of the file continues through the copy instead of the shared sector, copies
+// are counted in reference counts like links from data sectors
+typedef struct
+{
+	uint32_t count;
+	sector_copy_t copies[SECTOR_COPIES];
+} copies_sector_t;
+
+// place of slot contents in packed sector, small file keeps there its size followed by all its data, file which does
+// not fit into the sector anymore moves to a file sector and its slot keeps only the address of it, so that directory
+// entry and open handles of the file stay valid
+typedef struct
+{
+	uint16_t offset;
+	uint16_t length; // with PACKED_SLOT_MOVED flag for a moved file
+} packed_slot_t;
+
+// sector shared by headers of several small files, contents of slots are packed at its end
+typedef struct
+{
+	uint32_t used_slots;
+	uint32_t listed; // sector is in the list of packed sectors with free space
+	uint32_t next_packed_sector_addr;
+	// only places of slots up to the last used one are kept, contents of slots may follow them
+	packed_slot_t slots[PACKED_SLOTS];
+} packed_sector_t;
+
+typedef struct
+{
+	char name[MAX_FILENAME];
+	uint32_t file_sector_addr;
+} dir_entry_t;
+
+// directory entries are kept in a B+ tree sorted by name, leaves are linked for readdir
+typedef struct
+{
+	uint32_t leaf;
+	uint32_t count;
+	uint32_t next_leaf_addr;
+	dir_entry_t entries[BTREE_LEAF_ENTRIES];
+} btree_leaf_t;
+
+// child 'i' contains names lower than key 'i', child 'i' + 1 names greater or equal
+typedef struct
+{
+	uint32_t leaf;
+	uint32_t count;
+	uint32_t children[BTREE_INNER_KEYS + 1];
+	char keys[BTREE_INNER_KEYS][MAX_FILENAME];
+} btree_inner_t;
+
+// name of the last entry read through directory handle, reading continues with the next greater name, so changes of
+// the directory between reads neither repeat nor skip entries, there is no place for the name in the handle
+typedef struct
+{
+	int used;
+	char name[MAX_FILENAME];
+} dir_cursor_t;
+
+typedef struct
+{
+	uint32_t seq;
+	uint32_t count;
+	uint32_t sector_addrs[JOURNAL_CAPACITY];
+} journal_descriptor_t;
+
+typedef struct
+{
+	uint32_t addr; // 0 marks empty entry, metadata sector is never cached
+	int file_data; // file data never evict other sectors
+	uint8_t data[SECTOR_SIZE];
+} cached_sector_t;
+
+// direct mapped cache of headers, directory nodes and packed sectors, which are read on every access to a file
+// or directory, and of data sectors where reads stopped
+cached_sector_t sector_cache[CACHE_SECTORS];
+
+// cursors of open directory handles, the table grows when all of them are used
+dir_cursor_t *dir_cursors = NULL;
+uint32_t dir_cursors_size = 0;
+
+// metadata sectors modified since the last commit, they are written to the journal and then
+// to their place as one batch, until then reads are served from here
+uint32_t journal_sector_addrs[JOURNAL_CAPACITY];
+uint8_t journal_sectors[JOURNAL_CAPACITY][SECTOR_SIZE];
+uint32_t journal_count = 0;
+// copy of the batch which is being written, device is accessed without the journal lock, so reads of its sectors are
+// served from here until it is at its place, count is 0 when no batch is being written
+uint32_t flush_sector_addrs[JOURNAL_CAPACITY];
+uint8_t flush_sectors[JOURNAL_CAPACITY][SECTOR_SIZE];
+uint32_t flush_count = 0;
+uint32_t journal_ops = 0;
+uint32_t journal_seq = 0;
+int journal_recovered = 0;
+uint64_t journal_batch_start = 0; // time of the first change in batch, in milliseconds
+// batch is committed only when no operation is running, so it never contains a part of one, every operation
+// reserves sectors it may change, so that it never has to commit the batch
+uint32_t journal_active = 0;
+uint32_t journal_reserved = 0; // sectors which running operations may still add to the batch
+int journal_commit_wanted = 0; // new operations wait until the batch is committed
+int journal_refill_wanted = 0; // data pool is empty, but the free list is not, it is refilled at the next commit
+_Thread_local uint32_t journal_op_reserved = 0;
+_Thread_local uint32_t journal_op_used = 0;
+
+// locks are always taken in this order: namespace, file, allocator, packed sector, journal
+pthread_rwlock_t namespace_lock = PTHREAD_RWLOCK_INITIALIZER; // directory entries
+pthread_rwlock_t file_locks[FILE_LOCKS];					  // file headers and data sectors
+pthread_rwlock_t packed_locks[PACKED_LOCKS];				  // slots of packed sectors
+pthread_once_t file_locks_once = PTHREAD_ONCE_INIT;
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;	  // metadata sector and list of packed sectors
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER; // journal batch and sector cache
+pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;	  // operation ended or batch was written
+pthread_mutex_t dir_cursors_lock = PTHREAD_MUTEX_INITIALIZER; // cursors of directory handles
+
+// I/O is counted for the operation running in the current thread
+_Atomic uint64_t io_stats[IO_OPS][IO_COUNTERS];
+_Thread_local int io_current_op = IO_OP_FORMAT;
+const char *io_op_names[IO_OPS] = {"format", "creat", "open", "unlink", "rename", "read", "write",
+								   "seek", "stat", "mkdir", "rmdir", "opendir", "readdir", "sync", "clone", "close",
+								   "closedir"};
+
+void io_count(int counter, uint64_t amount)
+{
+	atomic_fetch_add_explicit(&io_stats[io_current_op][counter], amount, memory_order_relaxed);
+}
+
+// called at the start of every public operation
+void io_begin(int op)
+{
+	io_current_op = op;
+	io_count(IO_CALLS, 1);
+}
+
+void io_read(uint32_t addr, void *buffer)
+{
+	io_count(IO_SECTOR_READS, 1);
+	hdd_read(addr, buffer);
+}
+
+void io_write(uint32_t addr, const void *buffer)
+{
+	io_count(IO_SECTOR_WRITES, 1);
+	hdd_write(addr, buffer);
+}
+
+/**
+ * Returns value of I/O counter 'counter' (IO_CALLS, IO_SECTOR_READS, ...) summed over all calls of operation 'op'.
+ */
+uint64_t fs_io_stat(int op, int counter)
+{
+	return atomic_load_explicit(&io_stats[op][counter], memory_order_relaxed);
+}
+
+/**
+ * Clears all I/O counters.
+ */
+void fs_io_stats_reset()
+{
+	for (int op = 0; op < IO_OPS; op++)
+	{
+		for (int counter = 0; counter < IO_COUNTERS; counter++)
+			atomic_store_explicit(&io_stats[op][counter], 0, memory_order_relaxed);
+	}
+}
+
+/**
+ * Prints average I/O cost of every operation called since the last reset.
+ */
+void fs_io_stats_print()
+{
+	printf("%-8s %10s %10s %10s %12s %10s\n", "op", "calls", "reads/op", "writes/op", "bytes/op", "steps/op");
+	for (int op = 0; op < IO_OPS; op++)
+	{
+		uint64_t calls = fs_io_stat(op, IO_CALLS);
+		if (calls == 0)
+			continue;
+		printf("%-8s %10llu %10.2f %10.2f %12.1f %10.2f\n", io_op_names[op], (unsigned long long)calls,
+			   (double)fs_io_stat(op, IO_SECTOR_READS) / calls, (double)fs_io_stat(op, IO_SECTOR_WRITES) / calls,
+			   (double)fs_io_stat(op, IO_BYTES_COPIED) / calls, (double)fs_io_stat(op, IO_CHAIN_STEPS) / calls);
+	}
+}
+
+void init_file_locks()
+{
+	for (uint32_t i = 0; i < FILE_LOCKS; i++)
+		pthread_rwlock_init(&file_locks[i], NULL);
+	for (uint32_t i = 0; i < PACKED_LOCKS; i++)
+		pthread_rwlock_init(&packed_locks[i], NULL);
+}
+
+pthread_rwlock_t *file_lock(uint32_t file_addr)
+{
+	pthread_once(&file_locks_once, init_file_locks);
+	return &file_locks[file_addr % FILE_LOCKS];
+}
+
+pthread_rwlock_t *packed_lock(uint32_t sector_addr)
+{
+	pthread_once(&file_locks_once, init_file_locks);
+	return &packed_locks[sector_addr % PACKED_LOCKS];
+}
+
+int journal_find(uint32_t addr)
+{
+	for (uint32_t i = 0; i < journal_count; i++)
+	{
+		if (journal_sector_addrs[i] == addr)
+			return i;
+	}
+	return -1;
+}
+
+// index of sector in the batch which is being written, or -1, journal lock must be held
+int flush_find(uint32_t addr)
+{
+	for (uint32_t i = 0; i < flush_count; i++)
+	{
+		if (flush_sector_addrs[i] == addr)
+			return i;
+	}
+	return -1;
+}
+
+void cache_update(uint32_t addr, const void *buffer)
+{
+	cached_sector_t *entry = &sector_cache[addr % CACHE_SECTORS];
+	if (addr != FS_METADATA_SECTOR && entry->addr == addr)
+		memcpy(entry->data, buffer, SECTOR_SIZE);
+}
+
+void disk_read(uint32_t addr, void *buffer)
+{
+	pthread_mutex_lock(&journal_lock);
+	int journal_index = journal_find(addr);
+	if (journal_index >= 0)
+	{
+		memcpy(buffer, journal_sectors[journal_index], SECTOR_SIZE);
+		pthread_mutex_unlock(&journal_lock);
+		return;
+	}
+	int flush_index = flush_find(addr);
+	if (flush_index >= 0)
+	{
+		memcpy(buffer, flush_sectors[flush_index], SECTOR_SIZE);
+		pthread_mutex_unlock(&journal_lock);
+		return;
+	}
+
+	cached_sector_t *entry = &sector_cache[addr % CACHE_SECTORS];
+	if (addr != FS_METADATA_SECTOR && entry->addr == addr)
+	{
+		memcpy(buffer, entry->data, SECTOR_SIZE);
+		pthread_mutex_unlock(&journal_lock);
+		return;
+	}
+	if (addr == FS_METADATA_SECTOR)
+	{
+		// commit rewrites metadata sector even when it was not modified
+		io_read(addr, buffer);
+		pthread_mutex_unlock(&journal_lock);
+		return;
+	}
+	pthread_mutex_unlock(&journal_lock);
+
+	// sector is neither pending nor cached, so it can only change under a lock held by the caller, except
+	// reference count of a shared data sector, which is read under the allocator lock
+	io_read(addr, buffer);
+}
+
+// writes file data directly to their place
+void disk_write(uint32_t addr, const void *buffer)
+{
+	// sector waiting in the journal would be overwritten by its old image at checkpoint
+	pthread_mutex_lock(&journal_lock);
+	while (flush_find(addr) >= 0)
+		pthread_cond_wait(&journal_cond, &journal_lock);
+	int journal_index = journal_find(addr);
+	if (journal_index >= 0)
+	{
+		memcpy(journal_sectors[journal_index], buffer, SECTOR_SIZE);
+		pthread_mutex_unlock(&journal_lock);
+		return;
+	}
+
+	// keep cached copy up to date
+	cache_update(addr, buffer);
+	pthread_mutex_unlock(&journal_lock);
+	io_write(addr, buffer);
+}
+
+uint64_t journal_clock()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// number of descriptor sectors used by batch of 'count' sectors
+uint32_t journal_descriptor_sectors(uint32_t count)
+{
+	return (2 * ADDR_SIZE + count * ADDR_SIZE + SECTOR_SIZE - 1) / SECTOR_SIZE;
+}
+
+// writes journal batch and then checkpoints it, metadata sector is always part of the batch and carries
+// its sequence number, so recovery knows whether the batch reached its place, journal lock must be held, it is
+// released while the device is written, so readers do not wait for the whole checkpoint
+void journal_flush()
+{
+	// there is only one place for the batch in the journal
+	while (flush_count > 0)
+		pthread_cond_wait(&journal_cond, &journal_lock);
+	journal_commit_wanted = 0;
+	journal_ops = 0;
+	if (journal_count == 0)
+		return;
+
+	int metadata_index = journal_find(FS_METADATA_SECTOR);
+	if (metadata_index < 0)
+	{
+		metadata_index = journal_count++;
+		journal_sector_addrs[metadata_index] = FS_METADATA_SECTOR;
+		io_read(FS_METADATA_SECTOR, journal_sectors[metadata_index]);
+	}
+	fs_metadata_t *fs_metadata = (fs_metadata_t *)journal_sectors[metadata_index];
+	fs_metadata->checkpoint_seq = ++journal_seq;
+
+	uint8_t descriptor_buffer[JOURNAL_DESCRIPTOR_SECTORS * SECTOR_SIZE];
+	memset(descriptor_buffer, 0, sizeof(descriptor_buffer));
+	journal_descriptor_t *descriptor = (journal_descriptor_t *)descriptor_buffer;
+	descriptor->seq = journal_seq;
+	descriptor->count = journal_count;
+	for (uint32_t i = 0; i < journal_count; i++)
+	{
+		descriptor->sector_addrs[i] = journal_sector_addrs[i];
+		flush_sector_addrs[i] = journal_sector_addrs[i];
+		memcpy(flush_sectors[i], journal_sectors[i], SECTOR_SIZE);
+		if ((int)i != metadata_index)
+			cache_update(journal_sector_addrs[i], journal_sectors[i]);
+	}
+	flush_count = journal_count;
+	journal_count = 0;
+	pthread_mutex_unlock(&journal_lock);
+
+	for (uint32_t i = 0; i < flush_count; i++)
+		io_write(FS_JOURNAL_SECTOR + JOURNAL_DESCRIPTOR_SECTORS + i, flush_sectors[i]);
+	// batch is committed once the first descriptor sector with its sequence number is written
+	for (uint32_t i = journal_descriptor_sectors(flush_count) - 1; i > 0; i--)
+		io_write(FS_JOURNAL_SECTOR + i, descriptor_buffer + i * SECTOR_SIZE);
+	io_write(FS_JOURNAL_SECTOR, descriptor_buffer);
+
+	// metadata sector goes last, once it is written the whole batch is at its place
+	for (uint32_t i = 0; i < flush_count; i++)
+	{
+		if ((int)i != metadata_index)
+			io_write(flush_sector_addrs[i], flush_sectors[i]);
+	}
+	io_write(FS_METADATA_SECTOR, flush_sectors[metadata_index]);
+
+	pthread_mutex_lock(&journal_lock);
+	flush_count = 0;
+	pthread_cond_broadcast(&journal_cond);
+}
+
+// writes metadata sector through the journal
+void journal_write(uint32_t addr, const void *buffer)
+{
+	pthread_mutex_lock(&journal_lock);
+	int journal_index = journal_find(addr);
+	if (journal_index < 0)
+	{
+		// operations reserve their sectors in advance, so the batch is full only if one of them changed more than it
+		// reserved, committing a part of it is then the only way to keep the change, one place is kept for metadata
+		uint32_t capacity = JOURNAL_CAPACITY;
+		if (journal_find(FS_METADATA_SECTOR) < 0 && addr != FS_METADATA_SECTOR)
+			capacity--;
+		if (journal_count >= capacity)
+			journal_flush();
+		if (journal_count == 0)
+			journal_batch_start = journal_clock();
+		journal_index = journal_count++;
+		journal_sector_addrs[journal_index] = addr;
+		journal_op_used++;
+		if (journal_op_used <= journal_op_reserved)
+			journal_reserved--;
+	}
+	memcpy(journal_sectors[journal_index], buffer, SECTOR_SIZE);
+	pthread_mutex_unlock(&journal_lock);
+}
+
+// number of sectors which operation running in the current thread can still add to the batch
+uint32_t journal_room()
+{
+	return journal_op_used < journal_op_reserved ? journal_op_reserved - journal_op_used : 0;
+}
+
+// replays last committed batch if it did not reach its place before crash
+void journal_recover()
+{
+	journal_recovered = 1;
+
+	uint8_t descriptor_buffer[JOURNAL_DESCRIPTOR_SECTORS * SECTOR_SIZE];
+	memset(descriptor_buffer, 0, sizeof(descriptor_buffer));
+	io_read(FS_JOURNAL_SECTOR, descriptor_buffer);
+	journal_descriptor_t *descriptor = (journal_descriptor_t *)descriptor_buffer;
+	uint8_t fs_buffer[SECTOR_SIZE] = {0};
+	io_read(FS_METADATA_SECTOR, fs_buffer);
+	fs_metadata_t *fs_metadata = (fs_metadata_t *)fs_buffer;
+
+	journal_seq = descriptor->seq;
+	if (descriptor->seq == fs_metadata->checkpoint_seq)
+		return;
+
+	for (uint32_t i = 1; i < journal_descriptor_sectors(descriptor->count); i++)
+		io_read(FS_JOURNAL_SECTOR + i, descriptor_buffer + i * SECTOR_SIZE);
+	// metadata sector goes last, as in the checkpoint, replay which crashes before it is repeated
+	int metadata_index = -1;
+	for (uint32_t i = 0; i < descriptor->count; i++)
+	{
+		if (descriptor->sector_addrs[i] == FS_METADATA_SECTOR)
+		{
+			metadata_index = i;
+			continue;
+		}
+		uint8_t sector_buffer[SECTOR_SIZE] = {0};
+		io_read(FS_JOURNAL_SECTOR + JOURNAL_DESCRIPTOR_SECTORS + i, sector_buffer);
+		io_write(descriptor->sector_addrs[i], sector_buffer);
+	}
+	if (metadata_index >= 0)
+	{
+		io_read(FS_JOURNAL_SECTOR + JOURNAL_DESCRIPTOR_SECTORS + metadata_index, fs_buffer);
+		io_write(FS_METADATA_SECTOR, fs_buffer);
+	}
+}
+
+void load_metadata(void *fs_buffer)
+{
+	pthread_mutex_lock(&journal_lock);
+	if (!journal_recovered)
+		journal_recover();
+	pthread_mutex_unlock(&journal_lock);
+	disk_read(FS_METADATA_SECTOR, fs_buffer);
+}
+
+// reads sector and keeps it in the cache, data sector is kept only in an entry which does not hold other sector
+void cache_read(uint32_t addr, void *buffer, int file_data)
+{
+	pthread_mutex_lock(&journal_lock);
+	uint32_t read_seq = journal_seq;
+	pthread_mutex_unlock(&journal_lock);
+	disk_read(addr, buffer);
+
+	// cache holds only what is on the disk, pending sectors are served from the journal, and a commit
+	// during the read may have changed reference count of a shared sector
+	pthread_mutex_lock(&journal_lock);
+	cached_sector_t *entry = &sector_cache[addr % CACHE_SECTORS];
+	if (journal_find(addr) < 0 && journal_seq == read_seq && (!file_data || entry->addr == 0 || entry->file_data))
+	{
+		memcpy(entry->data, buffer, SECTOR_SIZE);
+		entry->addr = addr;
+		entry->file_data = file_data;
+	}
+	pthread_mutex_unlock(&journal_lock);
+}
+
+void cached_read(uint32_t addr, void *buffer)
+{
+	cache_read(addr, buffer, 0);
+}
+
+// address of the sector which the chain of file continues with instead of 'data_sector_addr'
+uint32_t copied_sector(const copies_sector_t *copies, uint32_t data_sector_addr)
+{
+	for (uint32_t i = 0; i < copies->count; i++)
+	{
+		if (copies->copies[i].shared_addr == data_sector_addr)
+			return copies->copies[i].copy_addr;
+	}
+	return data_sector_addr;
+}
+
+// reads copies of shared data sectors made by the file, they are needed on every access to its data sectors,
+// so they are kept in the cache
+void load_copies(file_sector_t *file, void *buffer)
+{
+	memset(buffer, 0, SECTOR_SIZE);
+	if (file->copies_sector_addr != 0)
+		cached_read(file->copies_sector_addr, buffer);
+}
+
+// takes a sector for metadata from the free list, or from the never used area above the high-water mark, or from
+// the data pool, metadata are only updated in memory, caller is responsible for writing them back, sector has to be
+// written through the journal, free list link must stay on the disk until the allocation is committed
+uint32_t alloc_sector(fs_metadata_t *fs_metadata)
+{
+	uint32_t free_addr = fs_metadata->first_free_sector_addr;
+	if (free_addr != 0)
+	{
+		uint8_t free_sector_buffer[SECTOR_SIZE] = {0};
+		disk_read(free_addr, free_sector_buffer);
+		free_sector_t *free_sector = (free_sector_t *)free_sector_buffer;
+		fs_metadata->first_free_sector_addr = free_sector->next_free_sector_addr;
+		return free_addr;
+	}
+
+	// free list is empty, take the first never used sector
+	if (fs_metadata->next_unused_sector_addr < hdd_size() / SECTOR_SIZE)
+		return fs_metadata->next_unused_sector_addr++;
+
+	if (fs_metadata->data_pool_count > 0)
+		return fs_metadata->data_pool[--fs_metadata->data_pool_count];
+
+	// we dont have any free sector
+	return 0;
+}
+
+// takes a sector for file data, which may be written directly, from the data pool, or from the never used area,
+// returns 0 if the disk is full, or if the pool has to be refilled from the free list first, '*refill' is set then
+uint32_t get_data_sector_addr(int *refill)
+{
+	pthread_mutex_lock(&alloc_lock);
+	uint8_t fs_buffer[SECTOR_SIZE] = {0};
+	load_metadata(fs_buffer);
+	fs_metadata_t *fs_metadata = (fs_metadata_t *)fs_buffer;
+	uint32_t data_addr = 0;
+	if (fs_metadata->data_pool_count > 0)
+	{
+		data_addr = fs_metadata->data_pool[--fs_metadata->data_pool_count];
+	}
+	else if (fs_metadata->first_free_sector_addr != 0)
+	{
+		// freed sectors are reused before the never used ones
+		pthread_mutex_lock(&journal_lock);
+		journal_refill_wanted = 1;
+		pthread_mutex_unlock(&journal_lock);
+		*refill = 1;
+	}
+	else if (fs_metadata->next_unused_sector_addr < hdd_size() / SECTOR_SIZE)
+	{
+		data_addr = fs_metadata->next_unused_sector_addr++;
+	}
+	if (data_addr != 0)
+		journal_write(FS_METADATA_SECTOR, fs_buffer);
+	pthread_mutex_unlock(&alloc_lock);
+	return data_addr;
+}
+
+// moves sectors from the free list to the data pool, called between operations, the batch is committed right after,
+// so the sectors are not in the free list anymore when their free list links are overwritten
+void refill_data_pool()
+{
+	pthread_mutex_lock(&alloc_lock);
+	uint8_t fs_buffer[SECTOR_SIZE] = {0};
+	load_metadata(fs_buffer);
+	fs_metadata_t *fs_metadata = (fs_metadata_t *)fs_buffer;
+	while (fs_metadata->data_pool_count < DATA_POOL_SECTORS && fs_metadata->first_free_sector_addr != 0)
+	{
+		uint8_t free_sector_buffer[SECTOR_SIZE] = {0};
+		disk_read(fs_metadata->first_free_sector_addr, free_sector_buffer);
+		fs_metadata->data_pool[fs_metadata->data_pool_count++] = fs_metadata->first_free_sector_addr;
+		fs_metadata->first_free_sector_addr = ((free_sector_t *)free_sector_buffer)->next_free_sector_addr;
+	}
+	journal_write(FS_METADATA_SECTOR, fs_buffer);
+	pthread_mutex_unlock(&alloc_lock);
+}
+
 int get_free_sector_addr()
 {
-	uint8_t fs_buffer[SECTOR_SIZE] = {0};
-	hdd_read(FS_METADATA_SECTOR, fs_buffer);
-	fs_metadata_t *fs_metadata = (fs_metadata_t *)fs_buffer;
-	int free_addr = fs_metadata->first_free_sector_addr;
-	// we dont have any free sector
-	if (free_addr == 0)
-		return 0;
+	pthread_mutex_lock(&alloc_lock);
+	uint8_t fs_buffer[SECTOR_SIZE] = {0};
+	load_metadata(fs_buffer);
+	fs_metadata_t *fs_metadata = (fs_metadata_t *)fs_buffer;
+	uint32_t free_addr = alloc_sector(fs_metadata);
+	if (free_addr != 0)
+	{
+		// update free sectors in fs metadata
+		journal_write(FS_METADATA_SECTOR, fs_buffer);
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	return free_addr;
+}
+
+// returns chain of data sectors from 'first_addr' to 'last_addr' to the free list, metadata are only updated
+// in memory, free list link is stored in place of data sector link, so only the last sector is rewritten
+void free_data_sectors(fs_metadata_t *fs_metadata, uint32_t first_addr, uint32_t last_addr)
+{
+	if (first_addr == 0)
+		return;
+
+	uint8_t last_buff[SECTOR_SIZE] = {0};
+	free_sector_t *last_sector = (free_sector_t *)last_buff;
+	last_sector->next_free_sector_addr = fs_metadata->first_free_sector_addr;
+	journal_write(last_addr, last_buff);
+	fs_metadata->first_free_sector_addr = first_addr;
+}
+
+void release_sectors(uint32_t first_addr, uint32_t last_addr)
+{
+	pthread_mutex_lock(&alloc_lock);
+	uint8_t fs_buffer[SECTOR_SIZE] = {0};
+	load_metadata(fs_buffer);
+	fs_metadata_t *fs_metadata = (fs_metadata_t *)fs_buffer;
+	free_data_sectors(fs_metadata, first_addr, last_addr);
+	journal_write(FS_METADATA_SECTOR, fs_buffer);
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+// commits the batch, while no operation is running, data pool is refilled before, journal lock must be held
+void journal_commit_idle()
+{
+	if (journal_refill_wanted)
+	{
+		// refill takes allocator lock, which goes before journal lock, operations wait for it as for a running one
+		journal_active++;
+		journal_refill_wanted = 0;
+		pthread_mutex_unlock(&journal_lock);
+		refill_data_pool();
+		pthread_mutex_lock(&journal_lock);
+		journal_active--;
+	}
+	journal_flush();
+	pthread_cond_broadcast(&journal_cond);
+}
+
+// called at the start of every modifying operation, before it takes any lock, waits until the batch has place for
+// 'sectors' sectors, which the operation may change, full batch is committed once running operations end
+void journal_begin_op(uint32_t sectors)
+{
+	pthread_mutex_lock(&journal_lock);
+	while (1)
+	{
+		// one place is kept for metadata sector, batch which has no place for the operation is committed first,
+		// otherwise the operation waits only for places reserved by running operations
+		if (journal_count + sectors + 1 > JOURNAL_CAPACITY || journal_refill_wanted)
+			journal_commit_wanted = 1;
+		// file data may be written to sectors taken from the free list by the batch being written
+		if (!journal_commit_wanted && flush_count == 0 && journal_count + journal_reserved + sectors + 1 <= JOURNAL_CAPACITY)
+			break;
+		if (journal_commit_wanted && journal_active == 0)
+			journal_commit_idle();
+		else
+			pthread_cond_wait(&journal_cond, &journal_lock);
+	}
+	journal_active++;
+	journal_reserved += sectors;
+	journal_op_reserved = sectors;
+	journal_op_used = 0;
+	pthread_mutex_unlock(&journal_lock);
+}
+
+// called at the end of every modifying operation, after it released its locks, operations are committed in groups,
+// the batch waits at most JOURNAL_BATCH_MS for them
+void journal_end_op()
+{
+	pthread_mutex_lock(&journal_lock);
+	journal_reserved -= journal_room();
+	journal_active--;
+	if (journal_op_used > 0)
+		journal_ops++;
+	journal_op_reserved = 0;
+	journal_op_used = 0;
+	if (journal_ops >= JOURNAL_BATCH_OPS || (journal_count > 0 && journal_clock() - journal_batch_start >= JOURNAL_BATCH_MS))
+		journal_commit_wanted = 1;
+	if (journal_commit_wanted && journal_active == 0)
+		journal_commit_idle();
+	pthread_cond_broadcast(&journal_cond);
+	pthread_mutex_unlock(&journal_lock);
+}
+
+// commits the batch once running operations end
+void journal_commit()
+{
+	pthread_mutex_lock(&journal_lock);
+	journal_commit_wanted = 1;
+	while (journal_active > 0)
+		pthread_cond_wait(&journal_cond, &journal_lock);
+	journal_commit_idle();
+	pthread_mutex_unlock(&journal_lock);
+}
+
+/**
+ * Writes all pending metadata changes to the disk.
+ */
+int fs_sync()
+{
+	io_begin(IO_OP_SYNC);
+	journal_commit();
+	return OK;
+}
+
+uint32_t packed_sector_addr(uint32_t file_addr)
+{
+	return (file_addr & ~PACKED_FILE) / PACKED_SLOTS;
+}
+
+uint32_t packed_slot_index(uint32_t file_addr)
+{
+	return (file_addr & ~PACKED_FILE) % PACKED_SLOTS;
+}
+
+// sets contents of slot 'index' to 'length' bytes from 'contents' and packs contents of all used slots at the end
+// of the sector, other slots keep their contents, index PACKED_SLOTS only packs them, returns FAIL without changing
+// the sector if the contents do not fit
+int pack_slots(uint8_t *packed_buffer, uint32_t index, const void *contents, uint32_t length, uint16_t flags)
+{
+	packed_sector_t *packed = (packed_sector_t *)packed_buffer;
+	uint8_t new_buffer[SECTOR_SIZE] = {0};
+	packed_sector_t *new_packed = (packed_sector_t *)new_buffer;
+	new_packed->used_slots = packed->used_slots;
+	new_packed->listed = packed->listed;
+	new_packed->next_packed_sector_addr = packed->next_packed_sector_addr;
+
+	uint32_t table_size = 0;
+	while (table_size < PACKED_SLOTS && (packed->used_slots >> table_size) != 0)
+		table_size++;
+	uint32_t table_end = 3 * ADDR_SIZE + table_size * sizeof(packed_slot_t);
+	uint32_t offset = SECTOR_SIZE;
+	for (uint32_t i = 0; i < table_size; i++)
+	{
+		if (!(packed->used_slots & (1u << i)))
+			continue;
+		const uint8_t *slot_contents = contents;
+		uint32_t slot_length = length;
+		uint16_t slot_flags = flags;
+		if (i != index)
+		{
+			slot_contents = packed_buffer + packed->slots[i].offset;
+			slot_length = packed->slots[i].length & ~PACKED_SLOT_MOVED;
+			slot_flags = packed->slots[i].length & PACKED_SLOT_MOVED;
+		}
+		if (offset < table_end + slot_length)
+			return FAIL;
+		offset -= slot_length;
+		memcpy(new_buffer + offset, slot_contents, slot_length);
+		new_packed->slots[i].offset = offset;
+		new_packed->slots[i].length = slot_length | slot_flags;
+	}
+	memcpy(packed_buffer, new_buffer, SECTOR_SIZE);
+	return OK;
+}
+
+// takes a free slot for header of a new file, returns its address with PACKED_FILE flag, or 0 if the disk is full
+uint32_t alloc_packed_slot()
+{
+	pthread_mutex_lock(&alloc_lock);
+	uint8_t fs_buffer[SECTOR_SIZE] = {0};
+	load_metadata(fs_buffer);
+	fs_metadata_t *fs_metadata = (fs_metadata_t *)fs_buffer;
+
+	uint8_t packed_buffer[SECTOR_SIZE] = {0};
+	packed_sector_t *packed = (packed_sector_t *)packed_buffer;
+	uint32_t empty_size = 0;
+	uint32_t sector_addr = fs_metadata->first_packed_sector_addr;
+	while (1)
+	{
+		int new_sector = sector_addr == 0;
+		if (new_sector)
+		{
+			// start a new packed sector in front of the list
+			sector_addr = alloc_sector(fs_metadata);
+			if (sector_addr == 0)
+			{
+				pthread_mutex_unlock(&alloc_lock);
+				return 0;
+			}
+			memset(packed_buffer, 0, SECTOR_SIZE);
+			packed->listed = 1;
+			packed->next_packed_sector_addr = fs_metadata->first_packed_sector_addr;
+			fs_metadata->first_packed_sector_addr = sector_addr;
+		}
+		// other slots of the sector may be just written by their files
+		pthread_rwlock_t *lock = packed_lock(sector_addr);
+		pthread_rwlock_wrlock(lock);
+		if (!new_sector)
+			disk_read(sector_addr, packed_buffer);
+
+		uint32_t slot = 0;
+		while (slot < PACKED_SLOTS && (packed->used_slots & (1u << slot)))
+			slot++;
+		if (slot < PACKED_SLOTS)
+		{
+			packed->used_slots |= 1u << slot;
+			if (pack_slots(packed_buffer, slot, &empty_size, ADDR_SIZE, 0) == OK)
+			{
+				journal_write(sector_addr, packed_buffer);
+				pthread_rwlock_unlock(lock);
+				journal_write(FS_METADATA_SECTOR, fs_buffer);
+				pthread_mutex_unlock(&alloc_lock);
+				return PACKED_FILE | (sector_addr * PACKED_SLOTS + slot);
+			}
+			packed->used_slots &= ~(1u << slot);
+		}
+
+		// full sector leaves the list, it returns there when one of its files is removed, and the next file starts
+		// a new sector, so that the list is not searched
+		fs_metadata->first_packed_sector_addr = packed->next_packed_sector_addr;
+		packed->next_packed_sector_addr = 0;
+		packed->listed = 0;
+		journal_write(sector_addr, packed_buffer);
+		pthread_rwlock_unlock(lock);
+		sector_addr = 0;
+	}
+}
+
+// removes packed sector followed by 'next_addr' from the list of packed sectors with free space, the list is singly
+// linked, so the sector linking to it is searched from the start, allocator lock must be held
+void unlist_packed_sector(fs_metadata_t *fs_metadata, uint32_t sector_addr, uint32_t next_addr)
+{
+	if (fs_metadata->first_packed_sector_addr == sector_addr)
+	{
+		fs_metadata->first_packed_sector_addr = next_addr;
+		return;
+	}
+	uint32_t prev_addr = fs_metadata->first_packed_sector_addr;
+	while (prev_addr != 0)
+	{
+		// links change only under allocator lock, but slots of the sector may be just written by their files
+		pthread_rwlock_t *lock = packed_lock(prev_addr);
+		pthread_rwlock_wrlock(lock);
+		uint8_t prev_buffer[SECTOR_SIZE] = {0};
+		disk_read(prev_addr, prev_buffer);
+		packed_sector_t *prev = (packed_sector_t *)prev_buffer;
+		uint32_t link_addr = prev->next_packed_sector_addr;
+		if (link_addr == sector_addr)
+		{
+			prev->next_packed_sector_addr = next_addr;
+			journal_write(prev_addr, prev_buffer);
+		}
+		pthread_rwlock_unlock(lock);
+		if (link_addr == sector_addr)
+			return;
+		io_count(IO_CHAIN_STEPS, 1);
+		prev_addr = link_addr;
+	}
+}
+
+// returns slot to its packed sector, packed sector without used slots is freed
+void free_packed_slot(uint32_t file_addr)
+{
+	pthread_mutex_lock(&alloc_lock);
+	uint8_t fs_buffer[SECTOR_SIZE] = {0};
+	load_metadata(fs_buffer);
+	fs_metadata_t *fs_metadata = (fs_metadata_t *)fs_buffer;
+
+	uint32_t sector_addr = packed_sector_addr(file_addr);
+	pthread_rwlock_t *lock = packed_lock(sector_addr);
+	pthread_rwlock_wrlock(lock);
+	uint8_t packed_buffer[SECTOR_SIZE] = {0};
+	disk_read(sector_addr, packed_buffer);
+	packed_sector_t *packed = (packed_sector_t *)packed_buffer;
+	packed->used_slots &= ~(1u << packed_slot_index(file_addr));
+	if (packed->used_slots == 0)
+	{
+		// slots are taken under allocator lock, so no file can use the sector anymore, its lock may be released
+		// before the list is searched, which takes locks of other packed sectors
+		pthread_rwlock_unlock(lock);
+		if (packed->listed)
+			unlist_packed_sector(fs_metadata, sector_addr, packed->next_packed_sector_addr);
+		free_data_sectors(fs_metadata, sector_addr, sector_addr);
+		journal_write(FS_METADATA_SECTOR, fs_buffer);
+		pthread_mutex_unlock(&alloc_lock);
+		return;
+	}
+	if (!packed->listed)
+	{
+		packed->listed = 1;
+		packed->next_packed_sector_addr = fs_metadata->first_packed_sector_addr;
+		fs_metadata->first_packed_sector_addr = sector_addr;
+		journal_write(FS_METADATA_SECTOR, fs_buffer);
+	}
+	pack_slots(packed_buffer, PACKED_SLOTS, NULL, 0, 0);
+	journal_write(sector_addr, packed_buffer);
+	pthread_rwlock_unlock(lock);
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+// reads header of file or directory as file sector, also when it is stored in a slot of packed sector, returns
+// address of the header, which is the file sector of a file moved out of its slot
+uint32_t load_header(uint32_t file_addr, void *buffer)
+{
+	if (!(file_addr & PACKED_FILE))
+	{
+		cached_read(file_addr, buffer);
+		return file_addr;
+	}
+
+	// other files of the sector may be just writing their slots, packed sectors are read on every access
+	// to their files, so they are kept in the cache
+	uint32_t sector_addr = packed_sector_addr(file_addr);
+	uint8_t packed_buffer[SECTOR_SIZE] = {0};
+	pthread_rwlock_t *lock = packed_lock(sector_addr);
+	pthread_rwlock_rdlock(lock);
+	cached_read(sector_addr, packed_buffer);
+	pthread_rwlock_unlock(lock);
+	packed_slot_t *slot = &((packed_sector_t *)packed_buffer)->slots[packed_slot_index(file_addr)];
+	uint32_t value = 0;
+	memcpy(&value, packed_buffer + slot->offset, ADDR_SIZE);
+	if (slot->length & PACKED_SLOT_MOVED)
+	{
+		cached_read(value, buffer);
+		return value;
+	}
+
+	memset(buffer, 0, SECTOR_SIZE);
+	file_sector_t *file = (file_sector_t *)buffer;
+	file->type = STAT_TYPE_FILE;
+	file->size = value;
+	memcpy(file->data, packed_buffer + slot->offset + ADDR_SIZE, file->size);
+	// generation of a file which was truncated follows its data
+	if (slot->length == ADDR_SIZE + file->size + ADDR_SIZE)
+		memcpy(&file->generation, packed_buffer + slot->offset + ADDR_SIZE + file->size, ADDR_SIZE);
+	return file_addr;
+}
+
+// writes header loaded by load_header to 'header_addr' returned by it, header stored into a slot makes the file small
+// again, if it was moved out of the slot, returns FAIL if the file does not fit into its packed sector
+int store_header(uint32_t header_addr, const void *buffer)
+{
+	if (!(header_addr & PACKED_FILE))
+	{
+		journal_write(header_addr, buffer);
+		return OK;
+	}
 
-	uint8_t free_sector_buffer[SECTOR_SIZE] = {0};
-	hdd_read(free_addr, free_sector_buffer);
-	free_sector_t *free_sector = (free_sector_t *)free_sector_buffer;
+	// other slots of the sector belong to other files, which may be written at the same time
+	const file_sector_t *file = (const file_sector_t *)buffer;
+	uint8_t contents[SECTOR_SIZE] = {0};
+	uint32_t length = ADDR_SIZE + file->size;
+	memcpy(contents, &file->size, ADDR_SIZE);
+	memcpy(contents + ADDR_SIZE, file->data, file->size);
+	if (file->generation != 0)
+	{
+		memcpy(contents + length, &file->generation, ADDR_SIZE);
+		length += ADDR_SIZE;
+	}
+	uint32_t sector_addr = packed_sector_addr(header_addr);
+	pthread_rwlock_t *lock = packed_lock(sector_addr);
+	pthread_rwlock_wrlock(lock);
+	uint8_t packed_buffer[SECTOR_SIZE] = {0};
+	disk_read(sector_addr, packed_buffer);
+	int result = pack_slots(packed_buffer, packed_slot_index(header_addr), contents, length, 0);
+	if (result == OK)
+		journal_write(sector_addr, packed_buffer);
+	pthread_rwlock_unlock(lock);
+	return result;
+}
 
-	// update next free sector in fs metadata
-	fs_metadata->first_free_sector_addr = free_sector->next_free_sector_addr;
-	hdd_write(FS_METADATA_SECTOR, fs_buffer);
-	return free_addr;
+// moves header of a small file to a new file sector and makes its slot forward there, header in 'buffer' is loaded
+// by load_header, returns address of the file sector, or 0 if the disk is full
+uint32_t unpack_header(uint32_t file_addr, const void *buffer)
+{
+	uint32_t header_addr = get_free_sector_addr();
+	if (header_addr == 0)
+		return 0;
+	journal_write(header_addr, buffer);
+
+	// forwarding address is never longer than the slot contents
+	uint32_t sector_addr = packed_sector_addr(file_addr);
+	pthread_rwlock_t *lock = packed_lock(sector_addr);
+	pthread_rwlock_wrlock(lock);
+	uint8_t packed_buffer[SECTOR_SIZE] = {0};
+	disk_read(sector_addr, packed_buffer);
+	pack_slots(packed_buffer, packed_slot_index(file_addr), &header_addr, ADDR_SIZE, PACKED_SLOT_MOVED);
+	journal_write(sector_addr, packed_buffer);
+	pthread_rwlock_unlock(lock);
+	return header_addr;
 }
-/**
- * Naformatovanie disku.
- *
- * Zavola sa vzdy, ked sa vytvara novy obraz disku.
- */
-void fs_format()
+
+// number of data sectors used by a file of given size, first bytes are stored directly in the file header,
+// rounding up is done in 64 bits, as it would overflow for sizes close to MAX_FILE_SIZE
+uint32_t data_sectors_count(uint32_t size)
+{
+	if (size <= FILE_SECTOR_DATA_SIZE)
+		return 0;
+	return ((uint64_t)size - FILE_SECTOR_DATA_SIZE + DATA_SECTOR_DATA_SIZE - 1) / DATA_SECTOR_DATA_SIZE;
+}
+
+// returns address of the first data sector whose order is at least 'order', or 0 if there is no such sector, sector
+// linked before it is stored into 'prev_addr', so that a new sector can be linked into the hole in front of it
+uint32_t find_data_sector(file_sector_t *file, const copies_sector_t *copies, uint32_t order, uint32_t *prev_addr)
 {
-	// create a linked list of free sectors
-	for (size_t i = 1; i < hdd_size() / SECTOR_SIZE; i++)
+	uint32_t count = data_sectors_count(file->size);
+	uint32_t prev = 0;
+	uint32_t data_sector_addr = file->first_data_sector_addr;
+	// the last byte of file is always written, so the last data sector has the last order and is known without
+	// walking the chain, its predecessor is not needed, as there is no hole in front of it
+	if (order >= count)
 	{
-		uint8_t free_buff[SECTOR_SIZE] = {0};
-		free_sector_t *free_sector = (free_sector_t *)free_buff;
-		if (i == hdd_size() / SECTOR_SIZE - 1)
-		{
-			free_sector->next_free_sector_addr = 0;
-		}
-		else
-		{
-			free_sector->next_free_sector_addr = i + 1;
-		}
-		hdd_write(i, free_buff);
+		prev = file->last_data_sector_addr;
+		data_sector_addr = 0;
+	}
+	else if (order + 1 == count)
+	{
+		data_sector_addr = file->last_data_sector_addr;
 	}
 
-	// zero sector reserved for filesystem metadata
-	uint8_t fs_buff[SECTOR_SIZE] = {0};
-	fs_metadata_t *fs_metadata = (fs_metadata_t *)fs_buff;
-	fs_metadata->first_file_sector_addr = 0;
-	fs_metadata->last_file_sector_addr = 0;
-	fs_metadata->first_free_sector_addr = 1;
-	fs_metadata->last_free_sector_addr = hdd_size() / SECTOR_SIZE - 1;
-	hdd_write(FS_METADATA_SECTOR, fs_buff);
+	while (data_sector_addr != 0 && data_sector_addr != file->last_data_sector_addr)
+	{
+		uint8_t data_buffer[SECTOR_SIZE] = {0};
+		disk_read(data_sector_addr, data_buffer);
+		data_sector_t *data_sector = (data_sector_t *)data_buffer;
+		if (data_sector->order >= order)
+			break;
+		io_count(IO_CHAIN_STEPS, 1);
+		prev = data_sector_addr;
+		data_sector_addr = copied_sector(copies, data_sector->next_data_sector_addr);
+	}
+	if (prev_addr != NULL)
+		*prev_addr = prev;
+	return data_sector_addr;
 }
 
-/**
- * Vytvorenie suboru.
- *
- * Volanie vytvori v suborovom systeme na zadanej ceste novy subor a vrati
- * handle nan. Ak subor uz existoval, bude skrateny na prazdny. Pozicia v subore bude
- * nastavena na 0ty byte. Ak adresar, v ktorom subor ma byt ulozeny, neexistuje,
- * vrati NULL (sam nevytvara adresarovu strukturu, moze vytvarat iba subory).
- */
+// reads data sector together with its reference count, which may be changed by writers of other files sharing it
+void load_data_sector(uint32_t data_sector_addr, void *buffer)
+{
+	pthread_mutex_lock(&alloc_lock);
+	disk_read(data_sector_addr, buffer);
+	pthread_mutex_unlock(&alloc_lock);
+}
 
-file_t *fs_creat(const char *path)
+// changes reference count of data sector by 'delta', copies the sector into 'buffer' and returns the new count,
+// sector which is not referenced anymore is going to be freed, so it is not written
+uint32_t change_refs(uint32_t data_sector_addr, int delta, void *buffer)
+{
+	pthread_mutex_lock(&alloc_lock);
+	disk_read(data_sector_addr, buffer);
+	data_sector_t *data_sector = (data_sector_t *)buffer;
+	data_sector->refs += delta;
+	if (data_sector->refs > 0)
+		journal_write(data_sector_addr, buffer);
+	pthread_mutex_unlock(&alloc_lock);
+	return data_sector->refs;
+}
+
+// drops one reference of the chain starting at 'data_sector_addr', sectors which are not referenced anymore are freed
+// up to the first one still used by another file
+void release_chain(uint32_t data_sector_addr)
 {
-	if (strrchr(path, PATHSEP) != path || strlen(path) > MAX_PATH)
+	uint32_t first_freed_addr = 0;
+	uint32_t last_freed_addr = 0;
+	while (data_sector_addr != 0)
 	{
-		return NULL;
+		uint8_t data_buffer[SECTOR_SIZE] = {0};
+		if (change_refs(data_sector_addr, -1, data_buffer) > 0)
+			break;
+		if (first_freed_addr == 0)
+			first_freed_addr = data_sector_addr;
+		last_freed_addr = data_sector_addr;
+		data_sector_t *data_sector = (data_sector_t *)data_buffer;
+		data_sector_addr = data_sector->next_data_sector_addr;
 	}
 
-	uint8_t fs_buffer[SECTOR_SIZE] = {0};
-	hdd_read(FS_METADATA_SECTOR, fs_buffer);
-	fs_metadata_t *fs_metadata = (fs_metadata_t *)fs_buffer;
+	// freed sectors are still linked one after another
+	if (first_freed_addr != 0)
+		release_sectors(first_freed_addr, last_freed_addr);
+}
 
-	uint32_t file_addr = fs_metadata->first_file_sector_addr;
+// returns data sectors of file to the free list, sectors shared with clones only lose one reference
+void release_file_data(file_sector_t *file)
+{
+	if (file->first_data_sector_addr == 0)
+		return;
+	if (!(file->flags & FILE_FLAG_SHARED))
+	{
+		release_sectors(file->first_data_sector_addr, file->last_data_sector_addr);
+		return;
+	}
 
-	while (1)
+	// copies continue the chain, so they hold the rest of it too
+	release_chain(file->first_data_sector_addr);
+	if (file->copies_sector_addr != 0)
 	{
-		uint8_t file_buff[SECTOR_SIZE] = {0};
-		hdd_read(file_addr, file_buff);
-		file_sector_t *file = (file_sector_t *)file_buff;
+		uint8_t copies_buffer[SECTOR_SIZE] = {0};
+		disk_read(file->copies_sector_addr, copies_buffer);
+		copies_sector_t *copies = (copies_sector_t *)copies_buffer;
+		for (uint32_t i = 0; i < copies->count; i++)
+			release_chain(copies->copies[i].copy_addr);
+		release_sectors(file->copies_sector_addr, file->copies_sector_addr);
+	}
+}
 
-		if (strncmp(path, file->filename, MAX_FILENAME) == 0)
+// makes data sectors of orders from 'first_order' to 'last_order' writable by the file, and also the sector which
+// a new sector of 'first_order' is going to be linked from, every shared sector is copied alone, the copy is linked
+// from the sector before it, if that one is private, otherwise it is recorded in 'copies_buffer', only when there
+// is no place for it, all shared sectors before it are copied too, header in 'file_buffer' and copies are updated
+// and stored, returns number of orders which can be written, it is lower than 'last_order' + 1 only when the disk
+// is full, or when the rest has to be copied by the next part of write, '*more' is set then
+uint32_t unshare_data_sectors(uint32_t header_addr, uint8_t *file_buffer, uint8_t *copies_buffer, uint32_t first_order,
+							  uint32_t last_order, int *more)
+{
+	file_sector_t *file = (file_sector_t *)file_buffer;
+	copies_sector_t *copies = (copies_sector_t *)copies_buffer;
+	uint32_t writable_orders = UINT32_MAX;
+	int record_copies = 1;
+
+restart:;
+	// 'prev' is the sector before the current one in the chain of the file, 0 for the header, a copy is written
+	// once its link to the next sector is known
+	uint32_t prev_addr = 0;
+	uint8_t prev_buffer[SECTOR_SIZE] = {0};
+	data_sector_t *prev_sector = (data_sector_t *)prev_buffer;
+	int prev_private = 1;
+	int prev_copy = 0;
+	// current sector is linked by 'link_addr', it differs from its address when it is a recorded copy
+	uint32_t link_addr = file->first_data_sector_addr;
+	uint32_t data_sector_addr = link_addr;
+	uint8_t data_buffer[SECTOR_SIZE] = {0};
+	data_sector_t *data_sector = (data_sector_t *)data_buffer;
+	if (data_sector_addr != 0)
+		load_data_sector(data_sector_addr, data_buffer);
+	while (data_sector_addr != 0 && data_sector->order <= last_order)
+	{
+		// sector is private, when nothing else links to it and the file reaches it through private sectors only
+		int private = data_sector->refs == 1 && (prev_private || data_sector_addr != link_addr);
+		int copy = 0;
+
+		uint32_t next_link_addr = data_sector->next_data_sector_addr;
+		uint32_t next_addr = copied_sector(copies, next_link_addr);
+		uint8_t next_buffer[SECTOR_SIZE] = {0};
+		data_sector_t *next_sector = (data_sector_t *)next_buffer;
+		if (next_addr != 0)
+			load_data_sector(next_addr, next_buffer);
+
+		// sector in front of a hole at 'first_order' gets linked the new sector
+		int written = data_sector->order >= first_order || next_addr == 0 || next_sector->order > first_order;
+		if (!private && (written || !record_copies))
 		{
-			// file with the same name exists
-			if (file->first_data_sector_addr != 0)
+			// copy of a sector reached through a shared one has to be recorded
+			int recorded = data_sector_addr != link_addr || (prev_addr != 0 && !prev_private);
+			int new_record = recorded && data_sector_addr == link_addr;
+			if (new_record && copies->count == SECTOR_COPIES)
+			{
+				// copying from the start of the chain leaves the sector before every copy private
+				if (prev_copy)
+					disk_write(prev_addr, prev_buffer);
+				record_copies = 0;
+				goto restart;
+			}
+
+			// copy may not fit into the batch of this part
+			uint32_t copy_addr = 0;
+			if (journal_room() >= JOURNAL_STEP_SECTORS)
+				copy_addr = get_data_sector_addr(more);
+			else
+				*more = 1;
+			if (copy_addr != 0 && recorded && file->copies_sector_addr == 0)
 			{
-				// file used data sectors, we need to add them into list of free sectors
-				uint32_t data_sector_addr = file->first_data_sector_addr;
-				while (1)
+				file->copies_sector_addr = get_free_sector_addr();
+				if (file->copies_sector_addr == 0)
 				{
-					uint8_t data_buff[SECTOR_SIZE] = {0};
-					hdd_read(data_sector_addr, data_buff);
-					data_sector_t *data_sector = (data_sector_t *)data_buff;
-
-					uint8_t free_buff[SECTOR_SIZE] = {0};
-					free_sector_t *free_sector = (free_sector_t *)free_buff;
-
-					free_sector->next_free_sector_addr = data_sector->next_data_sector_addr;
-					if (data_sector->next_data_sector_addr == 0)
-					{
-						// last data sector, link it with currect first free sector
-						free_sector->next_free_sector_addr = fs_metadata->first_free_sector_addr;
-						hdd_write(data_sector_addr, free_buff);
-						break;
-					}
-					hdd_write(data_sector_addr, free_buff);
-
-					data_sector_addr = data_sector->next_data_sector_addr;
+					release_sectors(copy_addr, copy_addr);
+					copy_addr = 0;
 				}
+			}
+			if (copy_addr == 0)
+			{
+				writable_orders = data_sector->order < first_order ? first_order : data_sector->order;
+				break;
+			}
 
-				// update address of first free sector in fs metadata
-				fs_metadata->first_free_sector_addr = file->first_data_sector_addr;
-				hdd_write(FS_METADATA_SECTOR, fs_buffer);
+			// the next sector is linked from both the sector and its copy
+			if (next_link_addr != 0)
+			{
+				uint8_t refs_buffer[SECTOR_SIZE] = {0};
+				change_refs(next_link_addr, 1, next_link_addr == next_addr ? next_buffer : refs_buffer);
 			}
-			file->first_data_sector_addr = 0;
-			file->last_data_sector_addr = 0;
-			file->size = 0;
-			hdd_write(file_addr, file_buff);
-			return fs_open(path);
-		}
-		else if (file->next_file_sector_addr == 0)
-		{
-			// we did not find file with same name, so we need to create new file
-			uint8_t new_file_buffer[SECTOR_SIZE] = {0};
-			file_sector_t *new_file = (file_sector_t *)new_file_buffer;
-			uint32_t new_file_addr = fs_metadata->first_free_sector_addr;
-			strcpy(new_file->filename, path);
-			new_file->size = 0;
-			new_file->last_data_sector_addr = 0;
-			new_file->first_data_sector_addr = 0;
-			new_file->next_file_sector_addr = 0;
-
-			if (fs_metadata->first_file_sector_addr == 0)
+			if (data_sector_addr != link_addr)
 			{
-				// file system does not contain any files
-				fs_metadata->first_file_sector_addr = 1;
-				fs_metadata->last_file_sector_addr = 1;
+				for (uint32_t i = 0; i < copies->count; i++)
+				{
+					if (copies->copies[i].shared_addr == link_addr)
+						copies->copies[i].copy_addr = copy_addr;
+				}
+			}
+			else if (new_record)
+			{
+				copies->copies[copies->count].shared_addr = link_addr;
+				copies->copies[copies->count].copy_addr = copy_addr;
+				copies->count++;
+			}
+			else if (prev_addr == 0)
+			{
+				file->first_data_sector_addr = copy_addr;
+				store_header(header_addr, file_buffer);
 			}
 			else
 			{
-				// add new created file to list of file sectors
-				uint32_t last_file_addr = fs_metadata->last_file_sector_addr;
-				uint8_t last_buff[SECTOR_SIZE] = {0};
-				hdd_read(last_file_addr, last_buff);
-				file_sector_t *last_file = (file_sector_t *)last_buff;
+				// link in an old sector is metadata and goes through the journal
+				prev_sector->next_data_sector_addr = copy_addr;
+				if (!prev_copy)
+					journal_write(prev_addr, prev_buffer);
+			}
+			if (recorded)
+				journal_write(file->copies_sector_addr, copies_buffer);
+			if (file->last_data_sector_addr == data_sector_addr)
+				file->last_data_sector_addr = copy_addr;
+
+			// recorded copy leaves the sector linked from the shared sector before it
+			if (!new_record)
+				release_chain(data_sector_addr);
+			file->generation++;
+			data_sector_addr = copy_addr;
+			data_sector->refs = 1;
+			private = 1;
+			copy = 1;
+		}
+
+		if (prev_copy)
+			disk_write(prev_addr, prev_buffer);
+		prev_addr = data_sector_addr;
+		memcpy(prev_buffer, data_buffer, SECTOR_SIZE);
+		prev_private = private;
+		prev_copy = copy;
+		link_addr = next_link_addr;
+		data_sector_addr = next_addr;
+		memcpy(data_buffer, next_buffer, SECTOR_SIZE);
+	}
+	if (prev_copy)
+		disk_write(prev_addr, prev_buffer);
+
+	// whole chain is private now
+	if (data_sector_addr == 0 && prev_private && file->copies_sector_addr == 0)
+		file->flags &= ~FILE_FLAG_SHARED;
+	return writable_orders;
+}
+
+// index of the child of inner node whose subtree may contain 'name'
+uint32_t btree_child_index(btree_inner_t *node, const char *name)
+{
+	uint32_t i = 0;
+	while (i < node->count && strncmp(name, node->keys[i], MAX_FILENAME) >= 0)
+		i++;
+	return i;
+}
+
+int btree_node_full(uint8_t *node_buffer)
+{
+	btree_leaf_t *node = (btree_leaf_t *)node_buffer;
+	if (node->leaf)
+		return node->count == BTREE_LEAF_ENTRIES;
+	return node->count == BTREE_INNER_KEYS;
+}
+
+// returns address of file sector of entry 'name' in tree with root 'node_addr', 0 if there is no such entry
+uint32_t btree_lookup(uint32_t node_addr, const char *name)
+{
+	while (node_addr != 0)
+	{
+		io_count(IO_CHAIN_STEPS, 1);
+		uint8_t node_buffer[SECTOR_SIZE] = {0};
+		disk_read(node_addr, node_buffer);
+		btree_leaf_t *leaf = (btree_leaf_t *)node_buffer;
+		if (leaf->leaf)
+		{
+			for (uint32_t i = 0; i < leaf->count; i++)
+			{
+				if (strncmp(leaf->entries[i].name, name, MAX_FILENAME) == 0)
+					return leaf->entries[i].file_sector_addr;
+			}
+			return 0;
+		}
+		btree_inner_t *inner = (btree_inner_t *)node_buffer;
+		node_addr = inner->children[btree_child_index(inner, name)];
+	}
+	return 0;
+}
+
+// returns address of the leaf whose names include 'name' in tree with root 'node_addr', 0 for empty tree
+uint32_t btree_find_leaf(uint32_t node_addr, const char *name)
+{
+	while (node_addr != 0)
+	{
+		io_count(IO_CHAIN_STEPS, 1);
+		uint8_t node_buffer[SECTOR_SIZE] = {0};
+		cached_read(node_addr, node_buffer);
+		btree_inner_t *inner = (btree_inner_t *)node_buffer;
+		if (inner->leaf)
+			return node_addr;
+		node_addr = inner->children[btree_child_index(inner, name)];
+	}
+	return 0;
+}
 
-				last_file->next_file_sector_addr = new_file_addr;
+// splits full child 'i' of 'parent' into two nodes, the new right node is placed after it in the parent
+int btree_split_child(uint32_t parent_addr, uint8_t *parent_buffer, uint32_t i, uint8_t *child_buffer)
+{
+	btree_inner_t *parent = (btree_inner_t *)parent_buffer;
+	uint32_t child_addr = parent->children[i];
+	uint32_t sibling_addr = get_free_sector_addr();
+	if (sibling_addr == 0)
+		return FAIL;
+
+	uint8_t sibling_buffer[SECTOR_SIZE] = {0};
+	char separator[MAX_FILENAME];
+	if (((btree_leaf_t *)child_buffer)->leaf)
+	{
+		// upper half of entries moves to the new leaf, its first name separates the leaves in parent
+		btree_leaf_t *child = (btree_leaf_t *)child_buffer;
+		btree_leaf_t *sibling = (btree_leaf_t *)sibling_buffer;
+		uint32_t half = child->count / 2;
+		sibling->leaf = 1;
+		sibling->count = child->count - half;
+		memcpy(sibling->entries, child->entries + half, sibling->count * sizeof(dir_entry_t));
+		sibling->next_leaf_addr = child->next_leaf_addr;
+		child->count = half;
+		child->next_leaf_addr = sibling_addr;
+		memcpy(separator, sibling->entries[0].name, MAX_FILENAME);
+	}
+	else
+	{
+		// middle key moves up to parent, keys above it and their children move to the new node
+		btree_inner_t *child = (btree_inner_t *)child_buffer;
+		btree_inner_t *sibling = (btree_inner_t *)sibling_buffer;
+		uint32_t half = child->count / 2;
+		memcpy(separator, child->keys[half], MAX_FILENAME);
+		sibling->leaf = 0;
+		sibling->count = child->count - half - 1;
+		memcpy(sibling->keys, child->keys[half + 1], sibling->count * MAX_FILENAME);
+		memcpy(sibling->children, child->children + half + 1, (sibling->count + 1) * ADDR_SIZE);
+		child->count = half;
+	}
+
+	memmove(parent->keys[i + 1], parent->keys[i], (parent->count - i) * MAX_FILENAME);
+	memmove(parent->children + i + 2, parent->children + i + 1, (parent->count - i) * ADDR_SIZE);
+	memcpy(parent->keys[i], separator, MAX_FILENAME);
+	parent->children[i + 1] = sibling_addr;
+	parent->count++;
+
+	journal_write(sibling_addr, sibling_buffer);
+	journal_write(child_addr, child_buffer);
+	journal_write(parent_addr, parent_buffer);
+	return OK;
+}
+
+// inserts entry into entry tree of 'dir', full nodes are split on the way down, so the tree stays valid
+// even when some allocation fails, header of 'dir' has to be stored even then, returns FAIL if there is no free sector
+int btree_insert(file_sector_t *dir, const char *name, uint32_t file_sector_addr)
+{
+	uint8_t node_buffer[SECTOR_SIZE] = {0};
+	uint32_t node_addr = dir->first_data_sector_addr;
+	if (node_addr == 0)
+	{
+		// empty directory gets its first leaf
+		node_addr = get_free_sector_addr();
+		if (node_addr == 0)
+			return FAIL;
+		btree_leaf_t *leaf = (btree_leaf_t *)node_buffer;
+		leaf->leaf = 1;
+		leaf->count = 0;
+		leaf->next_leaf_addr = 0;
+		dir->first_data_sector_addr = node_addr;
+	}
+	else
+	{
+		disk_read(node_addr, node_buffer);
+		if (btree_node_full(node_buffer))
+		{
+			// tree grows at the root
+			uint32_t root_addr = get_free_sector_addr();
+			if (root_addr == 0)
+				return FAIL;
+			uint8_t root_buffer[SECTOR_SIZE] = {0};
+			btree_inner_t *root = (btree_inner_t *)root_buffer;
+			root->leaf = 0;
+			root->count = 0;
+			root->children[0] = node_addr;
+			if (btree_split_child(root_addr, root_buffer, 0, node_buffer) == FAIL)
+			{
+				release_sectors(root_addr, root_addr);
+				return FAIL;
+			}
+			dir->first_data_sector_addr = root_addr;
+			dir->generation++;
+			node_addr = root_addr;
+			memcpy(node_buffer, root_buffer, SECTOR_SIZE);
+		}
+	}
 
-				fs_metadata->last_file_sector_addr = new_file_addr;
-				hdd_write(last_file_addr, last_buff);
+	while (1)
+	{
+		btree_leaf_t *leaf = (btree_leaf_t *)node_buffer;
+		if (leaf->leaf)
+		{
+			uint32_t i = leaf->count;
+			while (i > 0 && strncmp(name, leaf->entries[i - 1].name, MAX_FILENAME) < 0)
+			{
+				leaf->entries[i] = leaf->entries[i - 1];
+				i--;
 			}
+			memset(leaf->entries[i].name, 0, MAX_FILENAME);
+			strncpy(leaf->entries[i].name, name, MAX_FILENAME);
+			leaf->entries[i].file_sector_addr = file_sector_addr;
+			leaf->count++;
+			journal_write(node_addr, node_buffer);
+			return OK;
+		}
+
+		btree_inner_t *inner = (btree_inner_t *)node_buffer;
+		uint32_t i = btree_child_index(inner, name);
+		uint8_t child_buffer[SECTOR_SIZE] = {0};
+		disk_read(inner->children[i], child_buffer);
+		if (btree_node_full(child_buffer))
+		{
+			if (btree_split_child(node_addr, node_buffer, i, child_buffer) == FAIL)
+				return FAIL;
+			dir->generation++;
+			i = btree_child_index(inner, name);
+			disk_read(inner->children[i], child_buffer);
+		}
+		node_addr = inner->children[i];
+		memcpy(node_buffer, child_buffer, SECTOR_SIZE);
+	}
+}
+
+// removes entry 'name' from entry tree of 'dir', emptied leaf is freed and removed from its parent, parent left without
+// children is freed too, so that emptied directory has no tree, nodes are not merged otherwise, so lookups stay bounded
+// by the height the tree reached, returns FAIL if there is no such entry
+int btree_remove(file_sector_t *dir, const char *name)
+{
+	// inner nodes on the path from the root and indexes of children taken in them
+	uint32_t path_addrs[BTREE_MAX_HEIGHT];
+	uint32_t path_indexes[BTREE_MAX_HEIGHT];
+	uint32_t depth = 0;
+	uint32_t node_addr = dir->first_data_sector_addr;
+	uint8_t node_buffer[SECTOR_SIZE] = {0};
+	btree_leaf_t *leaf = (btree_leaf_t *)node_buffer;
+	while (1)
+	{
+		if (node_addr == 0 || depth == BTREE_MAX_HEIGHT)
+			return FAIL;
+		io_count(IO_CHAIN_STEPS, 1);
+		disk_read(node_addr, node_buffer);
+		if (leaf->leaf)
+			break;
+		btree_inner_t *inner = (btree_inner_t *)node_buffer;
+		path_addrs[depth] = node_addr;
+		path_indexes[depth] = btree_child_index(inner, name);
+		node_addr = inner->children[path_indexes[depth]];
+		depth++;
+	}
 
-			uint8_t free_sector_buffer[SECTOR_SIZE] = {0};
-			hdd_read(new_file_addr, free_sector_buffer);
-			free_sector_t *free_sector = (free_sector_t *)free_sector_buffer;
-			fs_metadata->first_free_sector_addr = free_sector->next_free_sector_addr;
+	uint32_t i = 0;
+	while (i < leaf->count && strncmp(leaf->entries[i].name, name, MAX_FILENAME) != 0)
+		i++;
+	if (i == leaf->count)
+		return FAIL;
+	memmove(leaf->entries + i, leaf->entries + i + 1, (leaf->count - i - 1) * sizeof(dir_entry_t));
+	leaf->count--;
+	if (leaf->count > 0)
+	{
+		journal_write(node_addr, node_buffer);
+		return OK;
+	}
+
+	// leaf before the emptied one is the last leaf of the subtree left of the path
+	uint32_t level = depth;
+	while (level > 0 && path_indexes[level - 1] == 0)
+		level--;
+	if (level > 0)
+	{
+		uint8_t prev_buffer[SECTOR_SIZE] = {0};
+		btree_inner_t *prev = (btree_inner_t *)prev_buffer;
+		disk_read(path_addrs[level - 1], prev_buffer);
+		uint32_t prev_addr = prev->children[path_indexes[level - 1] - 1];
+		disk_read(prev_addr, prev_buffer);
+		while (!prev->leaf)
+		{
+			prev_addr = prev->children[prev->count];
+			disk_read(prev_addr, prev_buffer);
+		}
+		((btree_leaf_t *)prev_buffer)->next_leaf_addr = leaf->next_leaf_addr;
+		journal_write(prev_addr, prev_buffer);
+	}
+	release_sectors(node_addr, node_addr);
+	dir->generation++;
 
-			hdd_write(FS_METADATA_SECTOR, fs_buffer);
-			hdd_write(new_file_addr, new_file_buffer);
-			return fs_open(path);
+	// parent loses the emptied child, child 'i' goes with key 'i' - 1 in front of it, the first child with the first key
+	while (depth > 0)
+	{
+		depth--;
+		uint8_t parent_buffer[SECTOR_SIZE] = {0};
+		btree_inner_t *parent = (btree_inner_t *)parent_buffer;
+		disk_read(path_addrs[depth], parent_buffer);
+		if (parent->count > 0)
+		{
+			uint32_t child = path_indexes[depth];
+			uint32_t key = child > 0 ? child - 1 : 0;
+			memmove(parent->keys[key], parent->keys[key + 1], (parent->count - key - 1) * MAX_FILENAME);
+			memmove(parent->children + child, parent->children + child + 1, (parent->count - child) * ADDR_SIZE);
+			parent->count--;
+			if (depth == 0 && parent->count == 0)
+			{
+				// root with a single child is replaced by it
+				dir->first_data_sector_addr = parent->children[0];
+				release_sectors(path_addrs[depth], path_addrs[depth]);
+			}
+			else
+			{
+				journal_write(path_addrs[depth], parent_buffer);
+			}
+			return OK;
 		}
-		file_addr = file->next_file_sector_addr;
+		release_sectors(path_addrs[depth], path_addrs[depth]);
 	}
+	dir->first_data_sector_addr = 0;
+	return OK;
+}
 
-	return NULL;
+// removes entry 'name' from directory
+void dir_remove(file_sector_t *dir, const char *name)
+{
+	btree_remove(dir, name);
+	dir->size--;
 }
 
-/**
- * Otvorenie existujuceho suboru.
- *
- * Ak zadany subor existuje, funkcia ho otvori a vrati handle nan. Pozicia v
- * subore bude nastavena na 0-ty bajt. Ak subor neexistuje, vrati NULL.
- */
-file_t *fs_open(const char *path)
+// returns address of file sector of entry 'name' in directory 'dir_addr', 0 if it does not exist or 'dir_addr' is not a directory
+uint32_t dir_lookup(uint32_t dir_addr, const char *name)
+{
+	uint8_t dir_buffer[SECTOR_SIZE] = {0};
+	load_header(dir_addr, dir_buffer);
+	file_sector_t *dir = (file_sector_t *)dir_buffer;
+	if (dir->type != STAT_TYPE_DIR)
+		return 0;
+	return btree_lookup(dir->first_data_sector_addr, name);
+}
+
+// finds directory which should contain the last component of 'path' and copies the component into 'name',
+// returns address of the directory file sector, or 0 if such directory does not exist
+uint32_t find_parent_dir(const char *path, char *name)
 {
+	if (path[0] != PATHSEP || strlen(path) > MAX_PATH)
+		return 0;
+
 	uint8_t fs_buffer[SECTOR_SIZE] = {0};
-	hdd_read(FS_METADATA_SECTOR, fs_buffer);
+	load_metadata(fs_buffer);
 	fs_metadata_t *fs_metadata = (fs_metadata_t *)fs_buffer;
-	uint32_t file_sector_addr = fs_metadata->first_file_sector_addr;
+	uint32_t dir_addr = fs_metadata->root_dir_sector_addr;
 
+	const char *component = path + 1;
 	while (1)
 	{
-		uint8_t file_buffer[SECTOR_SIZE] = {0};
-		hdd_read(file_sector_addr, file_buffer);
-		file_sector_t *file = ((file_sector_t *)file_buffer);
+		const char *separator = strchr(component, PATHSEP);
+		size_t length = separator != NULL ? (size_t)(separator - component) : strlen(component);
+		if (length == 0 || length >= MAX_FILENAME)
+			return 0;
+		memset(name, 0, MAX_FILENAME);
+		memcpy(name, component, length);
+		if (separator == NULL)
+			break;
 
-		if (strncmp(file->filename, path, MAX_FILENAME) == 0)
-		{
-			// file exists
-			file_t *fd = fd_alloc();
-			fd->info[FILE_ADDR] = file_sector_addr;
-			fd->info[FILE_CURSOR] = 0;
-			fd->info[2] = 0;
-			fd->info[3] = 0;
-			return fd;
-		}
-		else if (file->next_file_sector_addr == 0)
+		dir_addr = dir_lookup(dir_addr, name);
+		if (dir_addr == 0)
+			return 0;
+		component = separator + 1;
+	}
+
+	uint8_t dir_buffer[SECTOR_SIZE] = {0};
+	load_header(dir_addr, dir_buffer);
+	file_sector_t *dir = (file_sector_t *)dir_buffer;
+	if (dir->type != STAT_TYPE_DIR)
+		return 0;
+	return dir_addr;
+}
+
+// returns address of file sector of 'path', or 0 if it does not exist
+uint32_t find_file(const char *path)
+{
+	if (path[0] == PATHSEP && path[1] == '\0')
+	{
+		uint8_t fs_buffer[SECTOR_SIZE] = {0};
+		load_metadata(fs_buffer);
+		fs_metadata_t *fs_metadata = (fs_metadata_t *)fs_buffer;
+		return fs_metadata->root_dir_sector_addr;
+	}
+
+	char name[MAX_FILENAME];
+	uint32_t dir_addr = find_parent_dir(path, name);
+	if (dir_addr == 0)
+		return 0;
+	return dir_lookup(dir_addr, name);
+}
+
+file_t *open_file(uint32_t file_addr)
+{
+	file_t *fd = fd_alloc();
+	fd->info[FILE_ADDR] = file_addr;
+	fd->info[FILE_CURSOR] = 0;
+	fd->info[FILE_GENERATION] = 0;
+	fd->info[FILE_CURSOR_SECTOR] = 0;
+	return fd;
+}
+
+/**
+ * Naformatovanie disku.
+ *
+ * Zavola sa vzdy, ked sa vytvara novy obraz disku.
+ */
+void fs_format()
+{
+	io_begin(IO_OP_FORMAT);
+	// cached sectors and pending journal belong to the previous disk image
+	memset(sector_cache, 0, sizeof(sector_cache));
+	journal_count = 0;
+	flush_count = 0;
+	journal_ops = 0;
+	journal_seq = 0;
+	journal_recovered = 1;
+	journal_commit_wanted = 0;
+	journal_refill_wanted = 0;
+
+	uint8_t descriptor_buffer[SECTOR_SIZE] = {0};
+	io_write(FS_JOURNAL_SECTOR, descriptor_buffer);
+
+	// root directory is empty, so it does not have entry tree yet
+	uint32_t root_dir_addr = FS_JOURNAL_SECTOR + JOURNAL_DESCRIPTOR_SECTORS + JOURNAL_CAPACITY;
+	uint8_t root_dir_buff[SECTOR_SIZE] = {0};
+	file_sector_t *root_dir = (file_sector_t *)root_dir_buff;
+	root_dir->type = STAT_TYPE_DIR;
+	root_dir->size = 0;
+	root_dir->first_data_sector_addr = 0;
+	root_dir->last_data_sector_addr = 0;
+	io_write(root_dir_addr, root_dir_buff);
+
+	// zero sector reserved for filesystem metadata, all other sectors are free without touching them
+	uint8_t fs_buff[SECTOR_SIZE] = {0};
+	fs_metadata_t *fs_metadata = (fs_metadata_t *)fs_buff;
+	fs_metadata->root_dir_sector_addr = root_dir_addr;
+	fs_metadata->first_free_sector_addr = 0;
+	fs_metadata->next_unused_sector_addr = root_dir_addr + 1;
+	fs_metadata->first_packed_sector_addr = 0;
+	fs_metadata->checkpoint_seq = 0;
+	fs_metadata->data_pool_count = 0;
+	io_write(FS_METADATA_SECTOR, fs_buff);
+}
+
+// creates file or truncates the existing one
+file_t *create_file(const char *path)
+{
+	char name[MAX_FILENAME];
+	uint32_t dir_addr = find_parent_dir(path, name);
+	if (dir_addr == 0)
+		return NULL;
+
+	uint8_t dir_buffer[SECTOR_SIZE] = {0};
+	disk_read(dir_addr, dir_buffer);
+	file_sector_t *dir = (file_sector_t *)dir_buffer;
+
+	uint32_t file_addr = btree_lookup(dir->first_data_sector_addr, name);
+	if (file_addr != 0)
+	{
+		// file with the same name exists, it may be written through another handle
+		pthread_rwlock_t *lock = file_lock(file_addr);
+		pthread_rwlock_wrlock(lock);
+		uint8_t file_buff[SECTOR_SIZE] = {0};
+		uint32_t header_addr = load_header(file_addr, file_buff);
+		file_sector_t *file = (file_sector_t *)file_buff;
+		if (file->type != STAT_TYPE_FILE)
 		{
-			// file does not exist
+			pthread_rwlock_unlock(lock);
 			return NULL;
 		}
-		file_sector_addr = file->next_file_sector_addr;
+
+		// file used data sectors, we need to add them into list of free sectors, unless they are still used by clones
+		release_file_data(file);
+		if (file->first_data_sector_addr != 0)
+			file->generation++;
+		file->flags = 0;
+		file->first_data_sector_addr = 0;
+		file->last_data_sector_addr = 0;
+		file->copies_sector_addr = 0;
+		file->size = 0;
+		// bytes skipped by writing past the end are read from here as zeros
+		memset(file->data, 0, FILE_SECTOR_DATA_SIZE);
+		// empty file fits into its slot again, unless its generation does not fit into the packed sector
+		if (header_addr != file_addr && store_header(file_addr, file_buff) == OK)
+			release_sectors(header_addr, header_addr);
+		else
+			store_header(header_addr, file_buff);
+		pthread_rwlock_unlock(lock);
+		return open_file(file_addr);
+	}
+
+	// we did not find file with same name, so we need to create new file, it starts as an empty
+	// small file, so its header is allocated in a slot of packed sector
+	uint32_t new_file_addr = alloc_packed_slot();
+	if (new_file_addr == 0)
+		return NULL;
+	if (btree_insert(dir, name, new_file_addr) == FAIL)
+	{
+		free_packed_slot(new_file_addr);
+		journal_write(dir_addr, dir_buffer);
+		return NULL;
 	}
+	dir->size++;
+
+	journal_write(dir_addr, dir_buffer);
+	return open_file(new_file_addr);
+}
+
+/**
+ * Vytvorenie suboru.
+ *
+ * Volanie vytvori v suborovom systeme na zadanej ceste novy subor a vrati
+ * handle nan. Ak subor uz existoval, bude skrateny na prazdny. Pozicia v subore bude
+ * nastavena na 0ty byte. Ak adresar, v ktorom subor ma byt ulozeny, neexistuje,
+ * vrati NULL (sam nevytvara adresarovu strukturu, moze vytvarat iba subory).
+ */
+file_t *fs_creat(const char *path)
+{
+	io_begin(IO_OP_CREAT);
+	journal_begin_op(JOURNAL_OP_SECTORS);
+	pthread_rwlock_wrlock(&namespace_lock);
+	file_t *fd = create_file(path);
+	pthread_rwlock_unlock(&namespace_lock);
+	journal_end_op();
+	return fd;
+}
+
+// opens existing file
+file_t *open_path(const char *path)
+{
+	uint32_t file_sector_addr = find_file(path);
+	if (file_sector_addr == 0)
+		return NULL;
+
+	// header may be just written through another handle
+	uint8_t file_buffer[SECTOR_SIZE] = {0};
+	pthread_rwlock_t *lock = file_lock(file_sector_addr);
+	pthread_rwlock_rdlock(lock);
+	load_header(file_sector_addr, file_buffer);
+	pthread_rwlock_unlock(lock);
+	file_sector_t *file = ((file_sector_t *)file_buffer);
+	if (file->type != STAT_TYPE_FILE)
+		return NULL;
+	return open_file(file_sector_addr);
+}
+
+/**
+ * Otvorenie existujuceho suboru.
+ *
+ * Ak zadany subor existuje, funkcia ho otvori a vrati handle nan. Pozicia v
+ * subore bude nastavena na 0-ty bajt. Ak subor neexistuje, vrati NULL.
+ */
+file_t *fs_open(const char *path)
+{
+	io_begin(IO_OP_OPEN);
+	pthread_rwlock_rdlock(&namespace_lock);
+	file_t *fd = open_path(path);
+	pthread_rwlock_unlock(&namespace_lock);
+	return fd;
 }
 
 /**
@@ -254,11 +1886,55 @@ file_t *fs_open(const char *path)
  */
 int fs_close(file_t *fd)
 {
+	io_begin(IO_OP_CLOSE);
 	/* Uvolnime filedescriptor, aby sme neleakovali pamat */
 	fd_free(fd);
 	return OK;
 }
 
+// removes file and frees its sectors
+int unlink_file(const char *path)
+{
+	char name[MAX_FILENAME];
+	uint32_t dir_addr = find_parent_dir(path, name);
+	if (dir_addr == 0)
+		return FAIL;
+
+	uint8_t dir_buffer[SECTOR_SIZE] = {0};
+	disk_read(dir_addr, dir_buffer);
+	file_sector_t *dir = (file_sector_t *)dir_buffer;
+
+	uint32_t file_addr = btree_lookup(dir->first_data_sector_addr, name);
+	if (file_addr == 0)
+		return FAIL;
+
+	// wait for operations running through handles of the file
+	pthread_rwlock_t *lock = file_lock(file_addr);
+	pthread_rwlock_wrlock(lock);
+	uint8_t file_buff[SECTOR_SIZE] = {0};
+	uint32_t header_addr = load_header(file_addr, file_buff);
+	file_sector_t *file = (file_sector_t *)file_buff;
+	if (file->type != STAT_TYPE_FILE)
+	{
+		pthread_rwlock_unlock(lock);
+		return FAIL;
+	}
+
+	dir_remove(dir, name);
+	journal_write(dir_addr, dir_buffer);
+
+	// add all used sectors to the linked list of free sectors, sectors shared with clones stay in use
+	release_file_data(file);
+	if (header_addr != file_addr)
+		release_sectors(header_addr, header_addr);
+	if (file_addr & PACKED_FILE)
+		free_packed_slot(file_addr);
+	else
+		release_sectors(file_addr, file_addr);
+	pthread_rwlock_unlock(lock);
+	return OK;
+}
+
 /**
  * Odstrani subor na ceste 'path'.
  *
@@ -267,67 +1943,62 @@ int fs_close(file_t *fd)
  */
 int fs_unlink(const char *path)
 {
-	uint8_t buffer[SECTOR_SIZE] = {0};
-	hdd_read(FS_METADATA_SECTOR, buffer);
-	fs_metadata_t *fs_metadata = (fs_metadata_t *)buffer;
+	io_begin(IO_OP_UNLINK);
+	journal_begin_op(JOURNAL_OP_SECTORS);
+	pthread_rwlock_wrlock(&namespace_lock);
+	int result = unlink_file(path);
+	pthread_rwlock_unlock(&namespace_lock);
+	journal_end_op();
+	return result;
+}
 
-	uint32_t file_addr = fs_metadata->first_file_sector_addr;
-	uint8_t file_buff[SECTOR_SIZE] = {0};
+// moves directory entry
+int rename_entry(const char *oldpath, const char *newpath)
+{
+	char old_name[MAX_FILENAME];
+	char new_name[MAX_FILENAME];
+	uint32_t old_dir_addr = find_parent_dir(oldpath, old_name);
+	uint32_t new_dir_addr = find_parent_dir(newpath, new_name);
+	if (old_dir_addr == 0 || new_dir_addr == 0)
+		return FAIL;
 
-	while (1)
+	// directory can not be moved into itself
+	size_t old_length = strlen(oldpath);
+	if (strncmp(newpath, oldpath, old_length) == 0 && newpath[old_length] == PATHSEP)
+		return FAIL;
+
+	uint8_t old_dir_buffer[SECTOR_SIZE] = {0};
+	disk_read(old_dir_addr, old_dir_buffer);
+	file_sector_t *old_dir = (file_sector_t *)old_dir_buffer;
+	uint8_t new_dir_buffer[SECTOR_SIZE] = {0};
+	file_sector_t *new_dir = old_dir;
+	if (new_dir_addr != old_dir_addr)
 	{
-		hdd_read(file_addr, file_buff);
-		file_sector_t *file = (file_sector_t *)file_buff;
+		disk_read(new_dir_addr, new_dir_buffer);
+		new_dir = (file_sector_t *)new_dir_buffer;
+	}
 
-		if (strncmp(file->filename, path, MAX_FILENAME) == 0)
-		{
-			// add all used sectors to the linked list of free sectors
-			uint8_t last_free_sector_buff[SECTOR_SIZE] = {0};
-			hdd_read(fs_metadata->last_free_sector_addr, last_free_sector_buff);
-			data_sector_t *last_free_sector = (data_sector_t *)last_free_sector_buff;
-			last_free_sector->next_data_sector_addr = file_addr;
-			hdd_write(fs_metadata->last_free_sector_addr, last_free_sector_buff);
-
-			uint8_t removed_file_buff[SECTOR_SIZE] = {0};
-			free_sector_t *removed_file = (free_sector_t *)removed_file_buff;
-			removed_file->next_free_sector_addr = file->first_data_sector_addr;
-			hdd_write(file_addr, removed_file_buff);
-
-			if (file->first_data_sector_addr != 0)
-			{
-				// if file used data sectors
-				uint32_t next_data_sector_addr = file->first_data_sector_addr;
+	uint32_t file_sector_addr = btree_lookup(old_dir->first_data_sector_addr, old_name);
+	if (file_sector_addr == 0)
+		return FAIL;
+	if (strcmp(oldpath, newpath) == 0)
+		return OK;
+	if (btree_lookup(new_dir->first_data_sector_addr, new_name) != 0)
+		return FAIL;
 
-				while (1)
-				{
-					uint8_t next_data_sector_buff[SECTOR_SIZE] = {0};
-					hdd_read(next_data_sector_addr, next_data_sector_buff);
-					data_sector_t *next_data_sector = (data_sector_t *)next_data_sector_buff;
-
-					uint8_t free_sector_buff[SECTOR_SIZE] = {0};
-					hdd_write(next_data_sector_addr, free_sector_buff);
-					free_sector_t *free_sector = (free_sector_t *)free_sector_buff;
-					free_sector->next_free_sector_addr = next_data_sector->next_data_sector_addr;
-
-					if (next_data_sector->next_data_sector_addr == 0)
-					{
-						fs_metadata->last_free_sector_addr = next_data_sector_addr;
-						hdd_write(FS_METADATA_SECTOR, buffer);
-						break;
-					}
-
-					next_data_sector_addr = next_data_sector->next_data_sector_addr;
-				}
-			}
-			return OK;
-		}
-		else if (file->next_file_sector_addr == 0)
-		{
-			break;
-		}
-		file_addr = file->next_file_sector_addr;
+	// insert first, so nothing is lost when there is no space for new entry
+	if (btree_insert(new_dir, new_name, file_sector_addr) == FAIL)
+	{
+		journal_write(new_dir_addr, new_dir);
+		return FAIL;
 	}
-	return FAIL;
+	new_dir->size++;
+	dir_remove(old_dir, old_name);
+
+	journal_write(old_dir_addr, old_dir_buffer);
+	if (new_dir_addr != old_dir_addr)
+		journal_write(new_dir_addr, new_dir_buffer);
+	return OK;
 }
 
 /**
@@ -341,250 +2012,450 @@ int fs_unlink(const char *path)
  */
 int fs_rename(const char *oldpath, const char *newpath)
 {
-	uint8_t fs_buffer[SECTOR_SIZE] = {0};
-	hdd_read(FS_METADATA_SECTOR, fs_buffer);
-	fs_metadata_t *fs_metadata = (fs_metadata_t *)fs_buffer;
-	uint32_t file_sector_addr = fs_metadata->first_file_sector_addr;
+	io_begin(IO_OP_RENAME);
+	journal_begin_op(JOURNAL_OP_SECTORS);
+	pthread_rwlock_wrlock(&namespace_lock);
+	int result = rename_entry(oldpath, newpath);
+	pthread_rwlock_unlock(&namespace_lock);
+	journal_end_op();
+	return result;
+}
 
-	uint8_t buffer[SECTOR_SIZE] = {0};
-	while (1)
-	{
+// creates file 'dst' sharing data sectors with file 'src', sectors are copied only when one of the files writes them
+int clone_file(const char *src, const char *dst)
+{
+	uint32_t src_addr = find_file(src);
+	if (src_addr == 0)
+		return FAIL;
 
-		hdd_read(file_sector_addr, buffer);
-		file_sector_t *file_sector = (file_sector_t *)buffer;
+	char name[MAX_FILENAME];
+	uint32_t dir_addr = find_parent_dir(dst, name);
+	if (dir_addr == 0)
+		return FAIL;
 
-		if (strncmp(file_sector->filename, oldpath, MAX_FILENAME) == 0)
-		{
-			// file exists
-			strncpy(file_sector->filename, newpath, MAX_FILENAME);
-			hdd_write(file_sector_addr, buffer);
+	uint8_t dir_buffer[SECTOR_SIZE] = {0};
+	disk_read(dir_addr, dir_buffer);
+	file_sector_t *dir = (file_sector_t *)dir_buffer;
+	if (btree_lookup(dir->first_data_sector_addr, name) != 0)
+		return FAIL;
 
-			return OK;
-		}
-		else if (file_sector->next_file_sector_addr == 0)
-		{
-			// file does not exist
-			return FAIL;
-		}
+	// source may be written through its handles
+	pthread_rwlock_t *lock = file_lock(src_addr);
+	pthread_rwlock_wrlock(lock);
+	uint8_t src_buffer[SECTOR_SIZE] = {0};
+	uint32_t src_header_addr = load_header(src_addr, src_buffer);
+	file_sector_t *src_file = (file_sector_t *)src_buffer;
+	if (src_file->type != STAT_TYPE_FILE)
+	{
+		pthread_rwlock_unlock(lock);
+		return FAIL;
+	}
+
+	// clone gets its header in a slot of packed sector, small file is copied there, if it fits,
+	// clone of a file moved out of its slot moves too
+	uint32_t clone_addr = alloc_packed_slot();
+	if (clone_addr == 0)
+	{
+		pthread_rwlock_unlock(lock);
+		return FAIL;
+	}
+	// clone gets its own copies sector, which links to the same copies of shared sectors
+	uint32_t src_copies_addr = src_file->copies_sector_addr;
+	uint8_t copies_buffer[SECTOR_SIZE] = {0};
+	copies_sector_t *copies = (copies_sector_t *)copies_buffer;
+	uint32_t clone_copies_addr = 0;
+	if (src_copies_addr != 0)
+	{
+		clone_copies_addr = get_free_sector_addr();
+		disk_read(src_copies_addr, copies_buffer);
+		if (clone_copies_addr != 0)
+			journal_write(clone_copies_addr, copies_buffer);
+	}
+	src_file->copies_sector_addr = clone_copies_addr;
+
+	uint32_t clone_header_addr = clone_addr;
+	if (src_copies_addr != 0 && clone_copies_addr == 0)
+	{
+		clone_header_addr = 0;
+	}
+	else if (!(src_header_addr & PACKED_FILE) || store_header(clone_addr, src_buffer) == FAIL)
+	{
+		if (src_file->first_data_sector_addr != 0)
+			src_file->flags |= FILE_FLAG_SHARED;
+		clone_header_addr = unpack_header(clone_addr, src_buffer);
+	}
+	src_file->copies_sector_addr = src_copies_addr;
+	if (clone_header_addr == 0 || btree_insert(dir, name, clone_addr) == FAIL)
+	{
+		if (clone_header_addr != 0 && clone_header_addr != clone_addr)
+			release_sectors(clone_header_addr, clone_header_addr);
+		if (clone_copies_addr != 0)
+			release_sectors(clone_copies_addr, clone_copies_addr);
+		free_packed_slot(clone_addr);
+		journal_write(dir_addr, dir_buffer);
+		pthread_rwlock_unlock(lock);
+		return FAIL;
+	}
+	dir->size++;
 
-		file_sector_addr = file_sector->next_file_sector_addr;
+	if (src_file->first_data_sector_addr != 0)
+	{
+		// the first data sector gets a reference from the clone, the rest of the chain is shared through it
+		store_header(src_header_addr, src_buffer);
+		uint8_t data_buffer[SECTOR_SIZE] = {0};
+		change_refs(src_file->first_data_sector_addr, 1, data_buffer);
+		for (uint32_t i = 0; i < copies->count; i++)
+			change_refs(copies->copies[i].copy_addr, 1, data_buffer);
 	}
+
+	journal_write(dir_addr, dir_buffer);
+	pthread_rwlock_unlock(lock);
+	return OK;
 }
 
 /**
- * Nacita z aktualnej pozicie vo 'fd' do bufferu 'bytes' najviac 'size' bajtov.
+ * Creates file 'dst' with the same content as file 'src'.
  *
- * Z aktualnej pozicie v subore precita funkcia najviac 'size' bajtov; na konci
- * suboru funkcia vracia 0. Po nacitani dat zodpovedajuco upravi poziciu v
- * subore. Vrati pocet precitanych bajtov z 'bytes', alebo FAIL v pripade
- * zlyhania. Existujuci subor prepise.
+ * Both files share their data sectors until one of them writes into them, only
+ * the written sectors are copied then. The files stay independent, so writes,
+ * truncation or unlink of one do not change the other. Fails if 'src' is not
+ * a file or 'dst' already exists.
+ * Returns OK on success, FAIL otherwise.
  */
-int fs_read(file_t *fd, uint8_t *bytes, size_t size)
+int fs_clone(const char *src, const char *dst)
+{
+	io_begin(IO_OP_CLONE);
+	journal_begin_op(JOURNAL_OP_SECTORS);
+	pthread_rwlock_wrlock(&namespace_lock);
+	int result = clone_file(src, dst);
+	pthread_rwlock_unlock(&namespace_lock);
+	journal_end_op();
+	return result;
+}
+
+// reads from the cursor
+int read_file(file_t *fd, uint8_t *bytes, size_t size)
 {
 	uint32_t file_addr = fd->info[FILE_ADDR];
 	uint32_t file_cursor = fd->info[FILE_CURSOR];
 
 	uint8_t file_buffer[SECTOR_SIZE] = {0};
-	hdd_read(file_addr, file_buffer);
+	load_header(file_addr, file_buffer);
 	file_sector_t *file = (file_sector_t *)file_buffer;
-	int bytes_read = 0;
+	uint8_t copies_buffer[SECTOR_SIZE] = {0};
+	copies_sector_t *copies = (copies_sector_t *)copies_buffer;
+	size_t bytes_read = 0;
 
-	if (file_cursor > file->size)
+	if (file_cursor >= file->size)
 		return 0;
 	if (file_cursor + size > file->size)
 		size = file->size - file_cursor;
 	if (file_cursor < FILE_SECTOR_DATA_SIZE)
 	{
-		// we need to read from frist file data sector
-		int amount_to_read = size;
-		if (amount_to_read > FILE_SECTOR_DATA_SIZE)
+		// we need to read from the file header first
+		size_t amount_to_read = size;
+		if (file_cursor + amount_to_read > FILE_SECTOR_DATA_SIZE)
 			amount_to_read = FILE_SECTOR_DATA_SIZE - file_cursor;
-
-		for (int i = 0; i < amount_to_read; i++)
-		{
-			bytes[bytes_read] = file->data[file_cursor + i];
-			bytes_read++;
-			size--;
-		}
+		memcpy(bytes, file->data + file_cursor, amount_to_read);
+		bytes_read += amount_to_read;
+		file_cursor += amount_to_read;
 	}
-	// We need to read from the file data sector
-	if (size > 0)
+
+	uint32_t cursor_sector_addr = 0;
+	if (bytes_read < size)
 	{
-		// we also need to read from data sectors
-		uint32_t data_sector_addr = file->first_data_sector_addr;
-		if (data_sector_addr != 0)
+		// we also need to read from data sectors, sequential reading continues in the sector where the previous one stopped,
+		// which is the first data sector not before the cursor, unless the chain changed through another handle since then
+		load_copies(file, copies_buffer);
+		uint32_t data_sector_addr = 0;
+		if (fd->info[FILE_GENERATION] == file->generation)
+			data_sector_addr = fd->info[FILE_CURSOR_SECTOR];
+		if (data_sector_addr == 0)
+			data_sector_addr = find_data_sector(file, copies, (file_cursor - FILE_SECTOR_DATA_SIZE) / DATA_SECTOR_DATA_SIZE, NULL);
+		uint8_t data_buffer[SECTOR_SIZE];
+		data_sector_t *data_sector = (data_sector_t *)data_buffer;
+		uint32_t loaded_sector_addr = 0;
+		while (bytes_read < size)
 		{
-			// find a suitable data sector which matches cursor position
-			int cursor_data_sector_order = (file_cursor - FILE_SECTOR_DATA_SIZE) / (DATA_SECTOR_DATA_SIZE) + 1;
-			for (int i = 0; i < cursor_data_sector_order; i++)
-			{
-				uint8_t data_buffer[SECTOR_SIZE] = {0};
-				hdd_read(data_sector_addr, data_buffer);
-				data_sector_t *data_sector = (data_sector_t *)data_buffer;
-				if (i != (cursor_data_sector_order - 1))
-					data_sector_addr = data_sector->next_data_sector_addr;
-			}
+			uint32_t order = (file_cursor - FILE_SECTOR_DATA_SIZE) / DATA_SECTOR_DATA_SIZE;
+			size_t relative_file_cursor = (file_cursor - FILE_SECTOR_DATA_SIZE) % DATA_SECTOR_DATA_SIZE;
+			size_t amount_to_read = size - bytes_read;
+			if (relative_file_cursor + amount_to_read > DATA_SECTOR_DATA_SIZE)
+				amount_to_read = DATA_SECTOR_DATA_SIZE - relative_file_cursor;
 
-			while (size > 0)
+			if (data_sector_addr != 0 && data_sector_addr != loaded_sector_addr)
 			{
-				// reead from data sectors of file
-				uint8_t data_buffer[SECTOR_SIZE] = {0};
-				hdd_read(data_sector_addr, data_buffer);
-				data_sector_t *data_sector = (data_sector_t *)data_buffer;
-				int relative_file_cursor = (file_cursor - FILE_SECTOR_DATA_SIZE) % DATA_SECTOR_DATA_SIZE;
-				int amount_to_read = size;
-				if (amount_to_read > DATA_SECTOR_DATA_SIZE)
-					amount_to_read = DATA_SECTOR_DATA_SIZE;
-				if ((relative_file_cursor + amount_to_read) > DATA_SECTOR_DATA_SIZE)
-					amount_to_read = DATA_SECTOR_DATA_SIZE - relative_file_cursor;
-
-				for (int i = 0; i < amount_to_read; i++)
-				{
-					bytes[bytes_read] = data_sector->data[relative_file_cursor + i];
-					bytes_read++;
-					file_cursor++;
-					size--;
-				}
-				data_sector_addr = data_sector->next_data_sector_addr;
-				if (data_sector_addr == 0)
-					break;
+				// the next read continues in the last sector
+				cache_read(data_sector_addr, data_buffer, 1);
+				loaded_sector_addr = data_sector_addr;
 			}
+			int in_data_sector = data_sector_addr != 0 && data_sector->order == order;
+			if (in_data_sector)
+				memcpy(bytes + bytes_read, data_sector->data + relative_file_cursor, amount_to_read);
+			else
+				memset(bytes + bytes_read, 0, amount_to_read);
+			bytes_read += amount_to_read;
+			file_cursor += amount_to_read;
+
+			if (in_data_sector && relative_file_cursor + amount_to_read == DATA_SECTOR_DATA_SIZE)
+				data_sector_addr = copied_sector(copies, data_sector->next_data_sector_addr);
 		}
+		cursor_sector_addr = data_sector_addr;
 	}
 
-	fd->info[FILE_CURSOR] += bytes_read;
+	// the next read continues where this one stopped, unless there is seek or write in between
+	fd->info[FILE_GENERATION] = file->generation;
+	fd->info[FILE_CURSOR_SECTOR] = cursor_sector_addr;
+
+	fd->info[FILE_CURSOR] = file_cursor;
+	io_count(IO_BYTES_COPIED, bytes_read);
 	return bytes_read;
 }
 
 /**
- * Zapise do 'fd' na aktualnu poziciu 'size' bajtov z 'bytes'.
- *
- * Na aktualnu poziciu v subore zapise 'size' bajtov z 'bytes'. Ak zapis
- * presahuje hranice suboru, subor sa zvacsi; ak to nie je mozne, zapise sa
- * maximalny mozny pocet bajtov. Po zapise korektne upravi aktualnu poziciu v
- * subore a vracia pocet zapisanych bajtov z 'bytes'.
- * V pripade zlyhania vrati FAIL.
+ * Nacita z aktualnej pozicie vo 'fd' do bufferu 'bytes' najviac 'size' bajtov.
  *
- * Write existujuci obsah suboru prepisuje, nevklada dovnutra nove data.
- * Write pre poziciu tesne za koncom existujucich dat zvacsi velkost suboru.
+ * Z aktualnej pozicie v subore precita funkcia najviac 'size' bajtov; na konci
+ * suboru funkcia vracia 0. Po nacitani dat zodpovedajuco upravi poziciu v
+ * subore. Vrati pocet precitanych bajtov z 'bytes', alebo FAIL v pripade
+ * zlyhania. Existujuci subor prepise.
  */
-int fs_write(file_t *fd, const uint8_t *bytes, size_t size)
+int fs_read(file_t *fd, uint8_t *bytes, size_t size)
+{
+	io_begin(IO_OP_READ);
+	pthread_rwlock_t *lock = file_lock(fd->info[FILE_ADDR]);
+	pthread_rwlock_rdlock(lock);
+	int result = read_file(fd, bytes, size);
+	pthread_rwlock_unlock(lock);
+	return result;
+}
+
+// writes at the cursor as much as fits into the batch reserved for one part of write, '*more' is set when the rest
+// has to be written by the next part
+int write_file(file_t *fd, const uint8_t *bytes, size_t size, int *more)
 {
 	uint32_t file_addr = fd->info[FILE_ADDR];
 	uint32_t file_cursor = fd->info[FILE_CURSOR];
 
 	uint8_t buffer[SECTOR_SIZE] = {0};
-	hdd_read(file_addr, buffer);
+	uint32_t header_addr = load_header(file_addr, buffer);
 	file_sector_t *file = (file_sector_t *)buffer;
 
+	// writing breaks sequential reading
+	fd->info[FILE_CURSOR_SECTOR] = 0;
+
 	if (size == 0)
 		return 0;
-	int size_increase = 0;
-	int bytes_written = 0;
+	if (size > MAX_FILE_SIZE - file_cursor)
+		size = MAX_FILE_SIZE - file_cursor;
 
-	if (file_cursor < FILE_SECTOR_DATA_SIZE)
+	// small file stays in its slot while its data fit into the packed sector, otherwise it moves to a file sector,
+	// which gets the data written here too, when the disk is full, nothing is written
+	if (header_addr & PACKED_FILE)
 	{
-		// we need to start writing into the first file sector
-		int amount_to_write = size;
-		if (file_cursor + amount_to_write > FILE_SECTOR_DATA_SIZE)
-			amount_to_write = FILE_SECTOR_DATA_SIZE - file_cursor;
-		for (int i = 0; i < amount_to_write; i++)
+		if ((uint64_t)file_cursor + size <= FILE_SECTOR_DATA_SIZE)
 		{
-			file->data[file_cursor + i] = bytes[i];
-			bytes_written++;
-			if (file_cursor + i >= file->size)
+			memcpy(file->data + file_cursor, bytes, size);
+			if (file_cursor + size > file->size)
+				file->size = file_cursor + size;
+			if (store_header(header_addr, buffer) == OK)
 			{
-				size_increase++;
+				fd->info[FILE_CURSOR] = file_cursor + size;
+				io_count(IO_BYTES_COPIED, size);
+				return size;
 			}
 		}
+		header_addr = unpack_header(file_addr, buffer);
+		if (header_addr == 0)
+			return 0;
 	}
-	file_cursor += bytes_written;
-	size -= bytes_written;
-	if (size > 0)
+
+	// data sectors shared with clones are copied before they are written, when the disk is full,
+	// only the part which could be copied is written
+	uint8_t copies_buffer[SECTOR_SIZE] = {0};
+	copies_sector_t *copies = (copies_sector_t *)copies_buffer;
+	load_copies(file, copies_buffer);
+	if ((file->flags & FILE_FLAG_SHARED) && file_cursor + size > FILE_SECTOR_DATA_SIZE)
 	{
-		// we also need to write into data sectors
-		uint32_t data_sector_addr = file->first_data_sector_addr;
-		if (data_sector_addr == 0)
-		{
-			// file does not have data sectors yet
-			data_sector_addr = get_free_sector_addr();
-			file->first_data_sector_addr = data_sector_addr;
-		}
-		else
-		{
-			// find a suitable data sector address which matches cursor position
-			int cursor_data_sector_order = (file_cursor - FILE_SECTOR_DATA_SIZE) / (DATA_SECTOR_DATA_SIZE) + 1;
-			for (int i = 0; i < cursor_data_sector_order; i++)
-			{
-				uint8_t data_buffer[SECTOR_SIZE] = {0};
-				hdd_read(data_sector_addr, data_buffer);
-				data_sector_t *data_sector = (data_sector_t *)data_buffer;
-				if (i != (cursor_data_sector_order - 1))
-					data_sector_addr = data_sector->next_data_sector_addr;
-			}
-		}
+		uint32_t first_order = 0;
+		if (file_cursor > FILE_SECTOR_DATA_SIZE)
+			first_order = (file_cursor - FILE_SECTOR_DATA_SIZE) / DATA_SECTOR_DATA_SIZE;
+		uint32_t last_order = (file_cursor + size - 1 - FILE_SECTOR_DATA_SIZE) / DATA_SECTOR_DATA_SIZE;
+		uint64_t writable_end = FILE_SECTOR_DATA_SIZE + (uint64_t)unshare_data_sectors(header_addr, buffer, copies_buffer, first_order, last_order, more) * DATA_SECTOR_DATA_SIZE;
+		if (file_cursor >= writable_end)
+			size = 0;
+		else if (file_cursor + size > writable_end)
+			size = writable_end - file_cursor;
+	}
+	size_t bytes_written = 0;
+
+	if (file_cursor < FILE_SECTOR_DATA_SIZE)
+	{
+		// we need to start writing into the file header
+		size_t amount_to_write = size;
+		if (file_cursor + amount_to_write > FILE_SECTOR_DATA_SIZE)
+			amount_to_write = FILE_SECTOR_DATA_SIZE - file_cursor;
+		memcpy(file->data + file_cursor, bytes, amount_to_write);
+		bytes_written += amount_to_write;
+		file_cursor += amount_to_write;
+	}
 
-		// at this time we have found a correct data sector address, we can start writing
-		while (size > 0)
+	if (bytes_written < size)
+	{
+		// we also need to write into data sectors, every sector is written once its successor is known, because
+		// a new sector may have to be linked from it
+		uint32_t prev_addr = 0;
+		uint32_t data_sector_addr = find_data_sector(file, copies, (file_cursor - FILE_SECTOR_DATA_SIZE) / DATA_SECTOR_DATA_SIZE, &prev_addr);
+		uint8_t prev_buffer[SECTOR_SIZE] = {0};
+		data_sector_t *prev_sector = (data_sector_t *)prev_buffer;
+		int prev_pending = 0; // 'prev_buffer' was changed and waits for writing
+		int prev_new = 0;
+		int prev_relinked = 0;
+		while (bytes_written < size)
 		{
+			uint32_t order = (file_cursor - FILE_SECTOR_DATA_SIZE) / DATA_SECTOR_DATA_SIZE;
+			size_t relative_file_cursor = (file_cursor - FILE_SECTOR_DATA_SIZE) % DATA_SECTOR_DATA_SIZE;
+			size_t amount_to_write = size - bytes_written;
+			if (relative_file_cursor + amount_to_write > DATA_SECTOR_DATA_SIZE)
+				amount_to_write = DATA_SECTOR_DATA_SIZE - relative_file_cursor;
+
 			uint8_t data_buffer[SECTOR_SIZE] = {0};
-			hdd_read(data_sector_addr, data_buffer);
 			data_sector_t *data_sector = (data_sector_t *)data_buffer;
-			int relative_file_cursor = (file_cursor - FILE_SECTOR_DATA_SIZE) % DATA_SECTOR_DATA_SIZE;
-			int amount_to_write = size;
-			if (amount_to_write > DATA_SECTOR_DATA_SIZE)
-				amount_to_write = DATA_SECTOR_DATA_SIZE;
-			if ((relative_file_cursor + amount_to_write) > DATA_SECTOR_DATA_SIZE)
-				amount_to_write = DATA_SECTOR_DATA_SIZE - relative_file_cursor;
+			// old content has to be read unless the last sector gets all of its used bytes overwritten,
+			// its next address is 0 and its order is the last one
+			int overwrites_last_sector = data_sector_addr != 0 && data_sector_addr == file->last_data_sector_addr &&
+										 order + 1 == data_sectors_count(file->size) &&
+										 relative_file_cursor == 0 && file_cursor + amount_to_write >= file->size;
+			if (overwrites_last_sector)
+			{
+				data_sector->order = order;
+				data_sector->refs = 1;
+			}
+			else if (data_sector_addr != 0)
+				disk_read(data_sector_addr, data_buffer);
 
-			for (int i = 0; i < amount_to_write; i++)
+			// newly allocated data sector does not contain anything yet, so there is no need to read it
+			int new_data_sector = data_sector_addr == 0 || data_sector->order != order;
+			if (new_data_sector)
 			{
-				data_sector->data[relative_file_cursor + i] = bytes[bytes_written];
-				bytes_written++;
-				file_cursor++;
-				size--;
-				if (file_cursor >= file->size)
+				// cursor is in a hole or after the last data sector, if there is no free sector we stop writing
+				// and return amount of written bytes, the next part of write continues, if the sector does not
+				// fit into this one
+				uint32_t new_sector_addr = 0;
+				if (journal_room() >= JOURNAL_STEP_SECTORS)
+					new_sector_addr = get_data_sector_addr(more);
+				else
+					*more = 1;
+				if (new_sector_addr == 0)
+					break;
+				if (prev_addr != 0 && !prev_pending)
+					disk_read(prev_addr, prev_buffer);
+				// new sector takes over the link to the next one, which may be continued by its copy
+				memset(data_buffer, 0, SECTOR_SIZE);
+				if (prev_addr == 0)
+					data_sector->next_data_sector_addr = file->first_data_sector_addr;
+				else
+					data_sector->next_data_sector_addr = prev_sector->next_data_sector_addr;
+				data_sector->order = order;
+				data_sector->refs = 1;
+				if (data_sector_addr == 0)
+					file->last_data_sector_addr = new_sector_addr;
+				else
+					file->generation++;
+
+				if (prev_addr == 0)
+				{
+					file->first_data_sector_addr = new_sector_addr;
+				}
+				else
 				{
-					size_increase++;
+					prev_sector->next_data_sector_addr = new_sector_addr;
+					prev_pending = 1;
+					prev_relinked = 1;
 				}
+				data_sector_addr = new_sector_addr;
 			}
 
-			hdd_write(data_sector_addr, data_buffer);
-			data_sector_addr = data_sector->next_data_sector_addr;
-			if (data_sector_addr == 0)
-				data_sector_addr = get_free_sector_addr();
-			// we do not have any free sector, stop writing and return amount of written bytes
-			if (data_sector_addr == 0)
-				break;
+			// link to a new sector in an already reachable sector is metadata and goes through the journal
+			if (prev_pending && prev_relinked && !prev_new)
+				journal_write(prev_addr, prev_buffer);
+			else if (prev_pending)
+				disk_write(prev_addr, prev_buffer);
+
+			memcpy(data_sector->data + relative_file_cursor, bytes + bytes_written, amount_to_write);
+			bytes_written += amount_to_write;
+			file_cursor += amount_to_write;
+
+			prev_addr = data_sector_addr;
+			memcpy(prev_buffer, data_buffer, SECTOR_SIZE);
+			prev_pending = 1;
+			prev_new = new_data_sector;
+			prev_relinked = 0;
+			data_sector_addr = copied_sector(copies, data_sector->next_data_sector_addr);
 		}
+		if (prev_pending && prev_relinked && !prev_new)
+			journal_write(prev_addr, prev_buffer);
+		else if (prev_pending)
+			disk_write(prev_addr, prev_buffer);
 	}
 
 	fd->info[FILE_CURSOR] = file_cursor;
-	file->size += size_increase;
-	hdd_write(file_addr, buffer);
+	// size grows only by written bytes, cursor after a failed write past the end does not count
+	if (bytes_written > 0 && file_cursor > file->size)
+		file->size = file_cursor;
+	store_header(header_addr, buffer);
+	io_count(IO_BYTES_COPIED, bytes_written);
+	return bytes_written;
+}
+
+/**
+ * Zapise do 'fd' na aktualnu poziciu 'size' bajtov z 'bytes'.
+ *
+ * Na aktualnu poziciu v subore zapise 'size' bajtov z 'bytes'. Ak zapis
+ * presahuje hranice suboru, subor sa zvacsi; ak to nie je mozne, zapise sa
+ * maximalny mozny pocet bajtov. Po zapise korektne upravi aktualnu poziciu v
+ * subore a vracia pocet zapisanych bajtov z 'bytes'.
+ * V pripade zlyhania vrati FAIL.
+ *
+ * Write existujuci obsah suboru prepisuje, nevklada dovnutra nove data.
+ * Write pre poziciu tesne za koncom existujucich dat zvacsi velkost suboru.
+ */
+int fs_write(file_t *fd, const uint8_t *bytes, size_t size)
+{
+	io_begin(IO_OP_WRITE);
+	pthread_rwlock_t *lock = file_lock(fd->info[FILE_ADDR]);
+	// every part of a long write is a separate operation, so that it fits into one batch
+	size_t bytes_written = 0;
+	int more = 1;
+	while (more)
+	{
+		more = 0;
+		journal_begin_op(JOURNAL_WRITE_SECTORS);
+		pthread_rwlock_wrlock(lock);
+		bytes_written += write_file(fd, bytes + bytes_written, size - bytes_written, &more);
+		pthread_rwlock_unlock(lock);
+		journal_end_op();
+	}
 	return bytes_written;
 }
 
 /**
  * Zmeni aktualnu poziciu v subore na 'pos'-ty byte.
  *
- * Upravi aktualnu poziciu; ak je 'pos' mimo hranic suboru, vrati FAIL a pozicia
- * sa nezmeni, inac vracia OK.
+ * Upravi aktualnu poziciu; pozicia moze byt aj za koncom suboru, zapis na nu
+ * vytvori dieru, ktora sa cita ako nuly. Ak 'pos' presahuje maximalnu velkost
+ * suboru, vrati FAIL a pozicia sa nezmeni, inac vracia OK.
  */
 int fs_seek(file_t *fd, size_t pos)
 {
-	uint32_t file_addr = fd->info[FILE_ADDR];
-	uint8_t file_buffer[SECTOR_SIZE] = {0};
-
-	hdd_read(file_addr, file_buffer);
-	file_sector_t *file = (file_sector_t *)file_buffer;
-
-	if (pos >= file->size)
+	io_begin(IO_OP_SEEK);
+	if (pos > MAX_FILE_SIZE)
 	{
 		return FAIL;
 	}
 
 	fd->info[FILE_CURSOR] = pos;
+	fd->info[FILE_CURSOR_SECTOR] = 0;
 	return OK;
 }
 
@@ -597,6 +2468,26 @@ size_t fs_tell(file_t *fd)
 	return fd->info[FILE_CURSOR];
 }
 
+// fills stat of file or directory
+int stat_path(const char *path, struct fs_stat *fs_stat)
+{
+	uint32_t file_sector_addr = find_file(path);
+	if (file_sector_addr == 0)
+		return FAIL;
+
+	uint8_t buffer[SECTOR_SIZE] = {0};
+	pthread_rwlock_t *lock = file_lock(file_sector_addr);
+	pthread_rwlock_rdlock(lock);
+	load_header(file_sector_addr, buffer);
+	pthread_rwlock_unlock(lock);
+	file_sector_t *file_sector = (file_sector_t *)buffer;
+
+	fs_stat->st_size = file_sector->type == STAT_TYPE_FILE ? file_sector->size : 0;
+	fs_stat->st_nlink = 1;
+	fs_stat->st_type = file_sector->type;
+	return OK;
+}
+
 /**
  * Vrati informacie o 'path'.
  *
@@ -608,51 +2499,97 @@ size_t fs_tell(file_t *fd)
  *  STAT_TYPE_DIR, STAT_TYPE_SYMLINK
  *
  */
-
 int fs_stat(const char *path, struct fs_stat *fs_stat)
 {
+	io_begin(IO_OP_STAT);
+	pthread_rwlock_rdlock(&namespace_lock);
+	int result = stat_path(path, fs_stat);
+	pthread_rwlock_unlock(&namespace_lock);
+	return result;
+}
 
-	uint8_t fs_buffer[SECTOR_SIZE] = {0};
-	hdd_read(FS_METADATA_SECTOR, fs_buffer);
-	fs_metadata_t *fs_metadata = (fs_metadata_t *)fs_buffer;
+/* Level 3 */
+// creates empty directory
+int make_dir(const char *path)
+{
+	char name[MAX_FILENAME];
+	uint32_t dir_addr = find_parent_dir(path, name);
+	if (dir_addr == 0)
+		return FAIL;
 
-	uint32_t file_sector_addr = fs_metadata->first_file_sector_addr;
+	uint8_t dir_buffer[SECTOR_SIZE] = {0};
+	disk_read(dir_addr, dir_buffer);
+	file_sector_t *dir = (file_sector_t *)dir_buffer;
+	if (btree_lookup(dir->first_data_sector_addr, name) != 0)
+		return FAIL;
 
-	uint8_t buffer[SECTOR_SIZE] = {0};
-	while (1)
+	uint32_t new_dir_addr = get_free_sector_addr();
+	if (new_dir_addr == 0)
+		return FAIL;
+	if (btree_insert(dir, name, new_dir_addr) == FAIL)
 	{
+		release_sectors(new_dir_addr, new_dir_addr);
+		journal_write(dir_addr, dir_buffer);
+		return FAIL;
+	}
+	dir->size++;
 
-		hdd_read(file_sector_addr, buffer);
-		file_sector_t *file_sector = (file_sector_t *)buffer;
-
-		if (strncmp(file_sector->filename, path, MAX_FILENAME) == 0)
-		{
-			// file exists
-			fs_stat->st_size = file_sector->size;
-			fs_stat->st_nlink = 1;
-			fs_stat->st_type = STAT_TYPE_FILE;
-
-			return OK;
-		}
-		else if (file_sector->next_file_sector_addr == 0)
-		{
-			// file does not exist
-			return FAIL;
-		}
+	uint8_t new_dir_buffer[SECTOR_SIZE] = {0};
+	file_sector_t *new_dir = (file_sector_t *)new_dir_buffer;
+	new_dir->type = STAT_TYPE_DIR;
+	new_dir->size = 0;
+	new_dir->first_data_sector_addr = 0;
+	new_dir->last_data_sector_addr = 0;
 
-		file_sector_addr = file_sector->next_file_sector_addr;
-	}
+	journal_write(new_dir_addr, new_dir_buffer);
+	journal_write(dir_addr, dir_buffer);
 	return OK;
 }
 
-/* Level 3 */
 /**
  * Vytvori adresar 'path'.
  *
  * Ak cesta, v ktorej adresar ma byt, neexistuje, vrati FAIL (vytvara najviac
  * jeden adresar), pri korektnom vytvoreni OK.
  */
-int fs_mkdir(const char *path) { return FAIL; }
+int fs_mkdir(const char *path)
+{
+	io_begin(IO_OP_MKDIR);
+	journal_begin_op(JOURNAL_OP_SECTORS);
+	pthread_rwlock_wrlock(&namespace_lock);
+	int result = make_dir(path);
+	pthread_rwlock_unlock(&namespace_lock);
+	journal_end_op();
+	return result;
+}
+
+// removes empty directory
+int remove_dir(const char *path)
+{
+	char name[MAX_FILENAME];
+	uint32_t parent_addr = find_parent_dir(path, name);
+	if (parent_addr == 0)
+		return FAIL;
+
+	uint8_t parent_buffer[SECTOR_SIZE] = {0};
+	disk_read(parent_addr, parent_buffer);
+	file_sector_t *parent = (file_sector_t *)parent_buffer;
+
+	uint32_t dir_addr = btree_lookup(parent->first_data_sector_addr, name);
+	if (dir_addr == 0)
+		return FAIL;
+	uint8_t dir_buffer[SECTOR_SIZE] = {0};
+	load_header(dir_addr, dir_buffer);
+	file_sector_t *dir = (file_sector_t *)dir_buffer;
+	if (dir->type != STAT_TYPE_DIR || dir->size != 0)
+		return FAIL;
+
+	dir_remove(parent, name);
+	journal_write(parent_addr, parent_buffer);
+	// empty directory does not have entry tree
+	release_sectors(dir_addr, dir_addr);
+	return OK;
+}
 
 /**
  * Odstrani adresar 'path'.
@@ -660,7 +2597,67 @@ int fs_mkdir(const char *path) { return FAIL; }
  * Odstrani prazdny adresar, na ktory ukazuje 'path'; ak obsahuje subory, neexistuje alebo nie je
  * adresar, vrati FAIL; po uspesnom dokonceni vrati OK.
  */
-int fs_rmdir(const char *path) { return FAIL; }
+int fs_rmdir(const char *path)
+{
+	io_begin(IO_OP_RMDIR);
+	journal_begin_op(JOURNAL_OP_SECTORS);
+	pthread_rwlock_wrlock(&namespace_lock);
+	int result = remove_dir(path);
+	pthread_rwlock_unlock(&namespace_lock);
+	journal_end_op();
+	return result;
+}
+
+// takes unused directory cursor, returns its index, or UINT32_MAX if the table can not grow
+uint32_t alloc_dir_cursor()
+{
+	pthread_mutex_lock(&dir_cursors_lock);
+	uint32_t cursor = 0;
+	while (cursor < dir_cursors_size && dir_cursors[cursor].used)
+		cursor++;
+	if (cursor == dir_cursors_size)
+	{
+		uint32_t size = dir_cursors_size == 0 ? 16 : 2 * dir_cursors_size;
+		dir_cursor_t *cursors = realloc(dir_cursors, size * sizeof(dir_cursor_t));
+		if (cursors == NULL)
+		{
+			pthread_mutex_unlock(&dir_cursors_lock);
+			return UINT32_MAX;
+		}
+		memset(cursors + dir_cursors_size, 0, (size - dir_cursors_size) * sizeof(dir_cursor_t));
+		dir_cursors = cursors;
+		dir_cursors_size = size;
+	}
+	// empty name is lower than all names, so reading starts with the first entry
+	memset(&dir_cursors[cursor], 0, sizeof(dir_cursor_t));
+	dir_cursors[cursor].used = 1;
+	pthread_mutex_unlock(&dir_cursors_lock);
+	return cursor;
+}
+
+// opens directory for reading its entries
+file_t *open_dir_path(const char *path)
+{
+	uint32_t dir_addr = find_file(path);
+	if (dir_addr == 0)
+		return NULL;
+
+	uint8_t dir_buffer[SECTOR_SIZE] = {0};
+	load_header(dir_addr, dir_buffer);
+	file_sector_t *dir = (file_sector_t *)dir_buffer;
+	if (dir->type != STAT_TYPE_DIR)
+		return NULL;
+
+	uint32_t cursor = alloc_dir_cursor();
+	if (cursor == UINT32_MAX)
+		return NULL;
+	file_t *fd = fd_alloc();
+	fd->info[FILE_ADDR] = dir_addr;
+	fd->info[DIR_CURSOR] = cursor;
+	fd->info[DIR_LEAF] = 0;
+	fd->info[DIR_GENERATION] = 0;
+	return fd;
+}
 
 /**
  * Otvori adresar 'path' (na citanie poloziek)
@@ -668,7 +2665,59 @@ int fs_rmdir(const char *path) { return FAIL; }
  * Vrati handle na otvoreny adresar s poziciou nastavenou na 0; alebo NULL v
  * pripade zlyhania.
  */
-file_t *fs_opendir(const char *path) { return NULL; }
+file_t *fs_opendir(const char *path)
+{
+	io_begin(IO_OP_OPENDIR);
+	pthread_rwlock_rdlock(&namespace_lock);
+	file_t *fd = open_dir_path(path);
+	pthread_rwlock_unlock(&namespace_lock);
+	return fd;
+}
+
+// returns next directory entry, the first one with name greater than name of the last read entry, it is looked up
+// from the leaf of the last entry, unless entries moved between leaves since then, then the leaf is found again
+int read_dir(file_t *dir, char *item)
+{
+	uint8_t dir_buffer[SECTOR_SIZE] = {0};
+	cached_read(dir->info[FILE_ADDR], dir_buffer);
+	file_sector_t *dir_sector = (file_sector_t *)dir_buffer;
+	if (dir_sector->type != STAT_TYPE_DIR)
+		return FAIL;
+
+	char last_name[MAX_FILENAME];
+	pthread_mutex_lock(&dir_cursors_lock);
+	memcpy(last_name, dir_cursors[dir->info[DIR_CURSOR]].name, MAX_FILENAME);
+	pthread_mutex_unlock(&dir_cursors_lock);
+
+	uint32_t leaf_addr = dir->info[DIR_LEAF];
+	if (leaf_addr == 0 || dir->info[DIR_GENERATION] != dir_sector->generation)
+		leaf_addr = btree_find_leaf(dir_sector->first_data_sector_addr, last_name);
+	while (leaf_addr != 0)
+	{
+		uint8_t leaf_buffer[SECTOR_SIZE] = {0};
+		cached_read(leaf_addr, leaf_buffer);
+		btree_leaf_t *leaf = (btree_leaf_t *)leaf_buffer;
+		for (uint32_t i = 0; i < leaf->count; i++)
+		{
+			if (strncmp(leaf->entries[i].name, last_name, MAX_FILENAME) > 0)
+			{
+				// names are shorter than MAX_FILENAME, the entry always holds the terminating zero
+				memcpy(item, leaf->entries[i].name, MAX_FILENAME - 1);
+				item[MAX_FILENAME - 1] = '\0';
+				pthread_mutex_lock(&dir_cursors_lock);
+				memcpy(dir_cursors[dir->info[DIR_CURSOR]].name, leaf->entries[i].name, MAX_FILENAME);
+				pthread_mutex_unlock(&dir_cursors_lock);
+				dir->info[DIR_LEAF] = leaf_addr;
+				dir->info[DIR_GENERATION] = dir_sector->generation;
+				return OK;
+			}
+		}
+		// entries of this leaf were read, continue with the next one
+		io_count(IO_CHAIN_STEPS, 1);
+		leaf_addr = leaf->next_leaf_addr;
+	}
+	return FAIL;
+}
 
 /**
  * Nacita nazov dalsej polozky z adresara.
@@ -678,13 +2727,28 @@ file_t *fs_opendir(const char *path) { return NULL; }
  * V pripade problemu, alebo ak nasledujuca polozka neexistuje, vracia FAIL.
  * (V pripade jedneho suboru v adresari vracia FAIL az pri druhom volani.)
  */
-int fs_readdir(file_t *dir, char *item) { return FAIL; }
+int fs_readdir(file_t *dir, char *item)
+{
+	io_begin(IO_OP_READDIR);
+	pthread_rwlock_rdlock(&namespace_lock);
+	int result = read_dir(dir, item);
+	pthread_rwlock_unlock(&namespace_lock);
+	return result;
+}
 
 /**
  * Zatvori otvoreny adresar.
  * V pripade neuspechu vrati FAIL, inak OK.
  */
-int fs_closedir(file_t *dir) { return FAIL; }
+int fs_closedir(file_t *dir)
+{
+	io_begin(IO_OP_CLOSEDIR);
+	pthread_mutex_lock(&dir_cursors_lock);
+	dir_cursors[dir->info[DIR_CURSOR]].used = 0;
+	pthread_mutex_unlock(&dir_cursors_lock);
+	fd_free(dir);
+	return OK;
+}
 
 /* Level 4 */
 /**